@@ -29,12 +29,19 @@ BUGS:
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
 /* Includes in header file:
 #include <time.h>
 #include <windows.h>
@@ -145,540 +152,3074 @@ int getWindowSize(int *rows, int *cols) {
 // TODO: Should this be its own file???
 /*** SYNTAX HIGHLIGHTING ***/
 
+// 1 for chars that end a word (whitespace, operators, '\0'), built by editorInitSeparators()
+unsigned char separator_table[256];
+
+void editorInitSeparators() {
+  for (int c = 0; c < 256; c++)
+    separator_table[c] = isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
 int is_separator(int c) {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+  return separator_table[(unsigned char)c];
 }
 
-void editorUpdateSyntax(erow *row) {
-  // reset highlighting to match num rendered chars
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
+// Builds the keyword trie of syntax s once: KEYWORD2 words lose their '|' and every word
+// ends in a node that holds its class, so matching never rescans the keyword list
+// HL_NOCASE syntaxes store their keywords lowercased
+void editorCompileKeywords(struct editorSyntax *s) {
+  struct keywordTrie *t = malloc(sizeof(struct keywordTrie));
+  if (t == NULL) die("malloc");
+  memset(t->first, -1, sizeof(t->first));
+  t->nodes = NULL;
+  t->numnodes = 0;
+  int nodecap = 0;
+  int nocase = s->flags & HL_NOCASE;
+
+  for (int j = 0; s->keywords && s->keywords[j]; j++) {
+    char *kw = s->keywords[j];
+    int klen = strlen(kw);
+    int kw2 = klen > 0 && kw[klen - 1] == '|';
+    if (kw2) klen--; // KW2 end in | in the database
+    if (klen == 0) continue;
+
+    int n = -1;
+    for (int k = 0; k < klen; k++) {
+      char c = nocase ? tolower((unsigned char)kw[k]) : kw[k];
+      // Find the node for c: the root level is indexed by char, deeper levels are sibling lists
+      int prev = -1;
+      int next = (k == 0) ? t->first[(unsigned char)c] : t->nodes[n].child;
+      while (next != -1 && t->nodes[next].c != c) {
+        prev = next;
+        next = t->nodes[next].sibling;
+      }
+      if (next == -1) {
+        if (t->numnodes == nodecap) {
+          nodecap = nodecap ? nodecap * 2 : 64;
+          t->nodes = realloc(t->nodes, sizeof(struct keywordNode) * nodecap);
+          if (t->nodes == NULL) die("realloc");
+        }
+        next = t->numnodes++;
+        struct keywordNode *node = &t->nodes[next];
+        node->c = c;
+        node->hl = LEX_NORMAL;
+        node->kw = -1;
+        node->child = -1;
+        node->sibling = -1;
+        if (prev != -1) t->nodes[prev].sibling = next;
+        else if (k == 0) t->first[(unsigned char)c] = next;
+        else t->nodes[n].child = next;
+      }
+      n = next;
+    }
+    // An earlier duplicate in the list wins, as with the old linear scan
+    if (t->nodes[n].kw == -1) {
+      t->nodes[n].kw = j;
+      t->nodes[n].hl = kw2 ? LEX_KEYWORD2 : LEX_KEYWORD1;
+    }
+  }
+  s->keyword_trie = t;
+}
 
-  if (E.syntax == NULL) return;
+// Color of each lexClass
+unsigned char lex_class_hl[LEX_NUM_CLASSES] = {
+  HL_NORMAL, HL_COMMENT, HL_MLCOMMENT, HL_KEYWORD1, HL_KEYWORD2, HL_STRING, HL_NUMBER, HL_LABEL
+};
 
-  char **keywords = E.syntax->keywords;
+// Returns whether the len bytes of text end with delim
+int editorLexDelimEnds(char *text, int len, char *delim) {
+  int dlen = strlen(delim);
+  return dlen > 0 && dlen <= len && !memcmp(text + len - dlen, delim, dlen);
+}
 
-  char *scs = E.syntax->singleline_comment_start;
-  char *mcs = E.syntax->multiline_comment_start;
-  char *mce = E.syntax->multiline_comment_end;
+// Sets pending to the longest end of text that some delimiter starts with (but doesn't complete)
+void editorLexPending(char *text, int len, char **delims, int ndelims, char *pending) {
+  for (int k = len < LEX_MAX_DELIM - 1 ? len : LEX_MAX_DELIM - 1; k > 0; k--) {
+    for (int j = 0; j < ndelims; j++) {
+      if (k < (int)strlen(delims[j]) && !memcmp(delims[j], text + len - k, k)) {
+        memcpy(pending, text + len - k, k);
+        pending[k] = '\0';
+        return;
+      }
+    }
+  }
+  pending[0] = '\0';
+}
 
-  int scs_len = scs ? strlen(scs) : 0;
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
+// Returns whether prefixes holds the number prefix made of c0 and c1 (c1 0 for a one-char prefix)
+int editorLexPrefix(char **prefixes, int c0, int c1) {
+  for (int j = 0; prefixes && prefixes[j]; j++) {
+    unsigned char *p = (unsigned char *)prefixes[j];
+    if (p[0] == c0 && p[1] == c1 && (c1 == 0 || p[2] == '\0')) return 1;
+  }
+  return 0;
+}
 
-  int prev_sep = 1; // previous character was a separator (whitespace, operator, etc)
-  char in_string = 0; // 0 when not in string, else value of string character
-  int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+// Returns the kind of number c continues or starts, LEX_NUM_NONE if c isn't part of a number
+// A number starts at a digit or prefix that doesn't continue an identifier
+int editorLexNumber(struct editorSyntax *s, struct lexConfig *cf, int c) {
+  if (cf->num == LEX_NUM_ZERO && isalpha(c)) {
+    if (editorLexPrefix(s->hex_prefixes, '0', c)) return LEX_NUM_HEX;
+    if (editorLexPrefix(s->bin_prefixes, '0', c)) return LEX_NUM_BIN;
+  }
+  if (cf->num == LEX_NUM_HEX && isxdigit(c)) return LEX_NUM_HEX;
+  if (cf->num && (isdigit(c) || c == '.')) return cf->num == LEX_NUM_ZERO ? LEX_NUM_DEC : cf->num;
+  if (cf->prev_ident || cf->num) return LEX_NUM_NONE;
+  if (isdigit(c)) return c == '0' ? LEX_NUM_ZERO : LEX_NUM_DEC;
+  if (editorLexPrefix(s->hex_prefixes, c, 0)) return LEX_NUM_HEX;
+  if (editorLexPrefix(s->bin_prefixes, c, 0)) return LEX_NUM_BIN;
+  return LEX_NUM_NONE;
+}
 
-  int i = 0;
-  while (i < row->rsize) {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i-1] : HL_NORMAL;
-
-    // comments have highest priority (as long as we aren't in a string or multiline comment)
-    if (scs_len && !in_string && !in_comment) {
-      if (!strncmp(&row->render[i], scs, scs_len)) {
-        memset(&row->hl[i], HL_COMMENT, row->rsize-i); // entire rest of row is a comment
-        break;
-      }
-    }
+// Puts cf back in code, as after a separator (closed string or comment)
+void editorLexResetCode(struct lexConfig *cf) {
+  cf->mode = LEX_MODE_CODE;
+  cf->quote = 0;
+  cf->prev_sep = 1;
+  cf->prev_ident = 0;
+  cf->num = LEX_NUM_NONE;
+  cf->label = 0;
+  cf->kw = -1;
+  memset(cf->pending, 0, sizeof(cf->pending));
+}
 
-    if (mcs_len && mce_len && !in_string) {
-      if (in_comment) {
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(&row->render[i], mce, mce_len)) {
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-          i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
-          continue;
-        } else {
-          i++;
-          continue;
-        }
-      } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-        i += mcs_len;
-        in_comment = 1;
-        continue;
-      }
+// Reference lexer: reads byte c in state cf, sets out to the state after it and returns its
+// transition (w/o the next state); editorCompileSyntax() tabulates this for every state and byte
+// Delimiters, keywords and labels are only known once their last byte is read: the bytes
+// before it were painted as plain text and are repainted by the transition that settles them
+unsigned int editorLexStep(struct editorSyntax *s, struct lexConfig *cf, int c, struct lexConfig *out) {
+  *out = *cf;
+
+  char text[LEX_MAX_DELIM + 1]; // pending delimiter text followed by c
+  int len = strlen(cf->pending);
+  memcpy(text, cf->pending, len);
+  text[len++] = c;
+
+  switch (cf->mode) {
+  case LEX_MODE_LINECOMMENT:
+    return LEX_ENTRY(LEX_COMMENT, 0, 0, 0);
+  case LEX_MODE_STRING_ESC:
+    out->mode = LEX_MODE_STRING;
+    return LEX_ENTRY(LEX_STRING, 0, 0, 0);
+  case LEX_MODE_STRING:
+    if (c == '\\') out->mode = LEX_MODE_STRING_ESC;
+    else if (c == cf->quote) editorLexResetCode(out);
+    return LEX_ENTRY(LEX_STRING, 0, 0, 0);
+  case LEX_MODE_MLCOMMENT:
+    if (editorLexDelimEnds(text, len, s->multiline_comment_end))
+      editorLexResetCode(out);
+    else
+      editorLexPending(text, len, &s->multiline_comment_end, 1, out->pending);
+    return LEX_ENTRY(LEX_MLCOMMENT, 0, 0, 0);
+  }
+
+  // Comment delimiters come first; the single-line one wins a tie
+  char *delims[2];
+  int ndelims = 0;
+  char *scs = s->singleline_comment_start;
+  char *mcs = s->multiline_comment_start;
+  char *mce = s->multiline_comment_end;
+  if (scs && scs[0]) delims[ndelims++] = scs;
+  if (mcs && mcs[0] && mce && mce[0]) delims[ndelims++] = mcs;
+
+  int sep = is_separator(c);
+  struct keywordTrie *trie = s->keyword_trie;
+  // A keyword ends where a separator follows it
+  int kwclass = (sep && cf->kw != -1 && trie->nodes[cf->kw].kw != -1) ? trie->nodes[cf->kw].hl : -1;
+  int fill = (kwclass != -1) ? LEX_FILL_TOKEN : 0;
+  int fill_class = (kwclass != -1) ? kwclass : 0;
+
+  char *delim = NULL;
+  for (int j = 0; j < ndelims; j++)
+    if (editorLexDelimEnds(text, len, delims[j]) && (delim == NULL || strlen(delims[j]) > strlen(delim)))
+      delim = delims[j];
+  if (delim) {
+    int cls = (delim == scs) ? LEX_COMMENT : LEX_MLCOMMENT;
+    editorLexResetCode(out);
+    out->mode = (delim == scs) ? LEX_MODE_LINECOMMENT : LEX_MODE_MLCOMMENT;
+    int dlen = strlen(delim);
+    if (dlen > 1) return LEX_ENTRY(cls, dlen - 1, cls, 0);
+    return LEX_ENTRY(cls, fill, fill_class, 0);
+  }
+  editorLexPending(text, len, delims, ndelims, out->pending);
+
+  out->prev_sep = sep;
+  out->prev_ident = isalnum(c) || c == '_';
+
+  if ((s->flags & HL_HIGHLIGHT_STRINGS) && (c == '"' || c == '\'')) {
+    editorLexResetCode(out);
+    out->mode = LEX_MODE_STRING;
+    out->quote = c;
+    return LEX_ENTRY(LEX_STRING, fill, fill_class, 0);
+  }
+
+  out->num = (s->flags & HL_HIGHLIGHT_NUMBERS) ? editorLexNumber(s, cf, c) : LEX_NUM_NONE;
+  if (out->num) {
+    out->prev_sep = 0;
+    out->kw = -1;
+    out->label = 0;
+    return LEX_ENTRY(LEX_NUMBER, fill, fill_class, 0);
+  }
+
+  if ((s->flags & HL_LABELS) && cf->label && !cf->prev_sep && c == ':') {
+    out->prev_sep = 1;
+    out->kw = -1;
+    out->label = 0;
+    return LEX_ENTRY(LEX_LABEL, LEX_FILL_TOKEN, LEX_LABEL, 0);
+  }
+
+  if (sep) {
+    out->kw = -1;
+    out->label = 0;
+    return LEX_ENTRY(LEX_NORMAL, fill, fill_class, 0);
+  }
+
+  // Word char: keywords are followed through the trie from the start of the word
+  int kc = (s->flags & HL_NOCASE) ? tolower(c) : c;
+  if (cf->prev_sep) {
+    out->kw = trie->first[kc];
+    return LEX_ENTRY(LEX_NORMAL, 0, 0, 1);
+  }
+  if (cf->kw != -1) {
+    int n = trie->nodes[cf->kw].child;
+    while (n != -1 && (unsigned char)trie->nodes[n].c != kc) n = trie->nodes[n].sibling;
+    out->kw = n;
+  }
+  return LEX_ENTRY(LEX_NORMAL, 0, 0, 0);
+}
+
+// Returns the DFA state of lexer state cf, adding it if it is new (-1: LEX_MAX_STATES reached)
+int editorLexIntern(struct lexTable *lx, struct lexConfig *cf) {
+  unsigned int h = 2166136261u;
+  for (size_t k = 0; k < sizeof(*cf); k++)
+    h = (h ^ ((unsigned char *)cf)[k]) * 16777619u;
+
+  int slot = h & (lx->nslots - 1);
+  for (; lx->slots[slot] != -1; slot = (slot + 1) & (lx->nslots - 1))
+    if (!memcmp(&lx->configs[lx->slots[slot]], cf, sizeof(*cf))) return lx->slots[slot];
+
+  if (lx->numstates == LEX_MAX_STATES) return -1;
+  int st = lx->numstates++;
+  lx->configs = realloc(lx->configs, sizeof(struct lexConfig) * lx->numstates);
+  if (lx->configs == NULL) die("realloc");
+  lx->configs[st] = *cf;
+  lx->slots[slot] = st;
+
+  // Keep the hash at most half full
+  if (lx->numstates * 2 > lx->nslots) {
+    free(lx->slots);
+    lx->nslots *= 2;
+    lx->slots = malloc(sizeof(int) * lx->nslots);
+    if (lx->slots == NULL) die("malloc");
+    memset(lx->slots, -1, sizeof(int) * lx->nslots);
+    for (int j = 0; j < lx->numstates; j++) {
+      unsigned int hj = 2166136261u;
+      for (size_t k = 0; k < sizeof(*cf); k++)
+        hj = (hj ^ ((unsigned char *)&lx->configs[j])[k]) * 16777619u;
+      int sj = hj & (lx->nslots - 1);
+      while (lx->slots[sj] != -1) sj = (sj + 1) & (lx->nslots - 1);
+      lx->slots[sj] = j;
     }
+  }
+  return st;
+}
 
-    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if (in_string) {
-        row->hl[i] = HL_STRING;
-        // handle escaped quotes
-        if (c == '\\' && i+1 < row->rsize) {
-          row->hl[i+1] = HL_STRING;
-          i += 2;
-          continue;
-        }
-        if (c == in_string) in_string = 0;
-        i++;
-        prev_sep = 1;
-        continue;
-      } else {
-        if (c == '"' || c == '\'') {
-          in_string = c;
-          row->hl[i] = HL_STRING;
-          i++;
-          continue;
-        }
-      }
+// Compiles syntax s into one state-transition table: every lexer state reachable from the start
+// of a line becomes a DFA state with a transition for each of the 256 bytes
+// Returns -1 (and leaves s->lexer NULL) if the syntax needs more than LEX_MAX_STATES states
+int editorCompileSyntax(struct editorSyntax *s) {
+  if (s->keyword_trie == NULL) editorCompileKeywords(s);
+
+  struct lexTable *lx = malloc(sizeof(struct lexTable));
+  if (lx == NULL) die("malloc");
+  lx->next = NULL;
+  lx->numstates = 0;
+  lx->configs = NULL;
+  lx->nslots = 256;
+  lx->slots = malloc(sizeof(int) * lx->nslots);
+  if (lx->slots == NULL) die("malloc");
+  memset(lx->slots, -1, sizeof(int) * lx->nslots);
+
+  struct lexConfig cf;
+  memset(&cf, 0, sizeof(cf)); // configs are hashed bytewise: padding must be zero too
+  editorLexResetCode(&cf);
+  cf.label = (s->flags & HL_LABELS) != 0;
+  lx->start = editorLexIntern(lx, &cf);
+  char *mcs = s->multiline_comment_start;
+  char *mce = s->multiline_comment_end;
+  if (mcs && mcs[0] && mce && mce[0]) {
+    editorLexResetCode(&cf);
+    cf.mode = LEX_MODE_MLCOMMENT;
+    lx->comment_start = editorLexIntern(lx, &cf);
+  } else
+    lx->comment_start = lx->start;
+
+  // States are numbered in the order they are found, so this visits each one once
+  int statecap = 0;
+  for (int st = 0; st < lx->numstates; st++) {
+    if (st == statecap) {
+      statecap = statecap ? statecap * 2 : 64;
+      lx->next = realloc(lx->next, sizeof(unsigned int) * 256 * statecap);
+      if (lx->next == NULL) die("realloc");
     }
-    
-    // numbers should have lower precedent than strings/comments
-    if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-          (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
-        i++;
-        prev_sep = 0;
-        continue;
+    for (int c = 0; c < 256; c++) {
+      struct lexConfig from = lx->configs[st]; // configs may move while interning
+      unsigned int t = editorLexStep(s, &from, c, &cf);
+      int to = editorLexIntern(lx, &cf);
+      if (to == -1) {
+        free(lx->next);
+        free(lx->configs);
+        free(lx->slots);
+        free(lx);
+        return -1;
       }
+      lx->next[st * 256 + c] = t | to;
     }
+  }
 
-    // Keywords (1 and 2)
-    if (prev_sep) {
-      int j;
-      for (j = 0; keywords[j]; j++) {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2) klen--; // KW2 end in | in the database
-
-        if (!strncmp(&row->render[i], keywords[j], klen) &&
-            is_separator(row->render[i+klen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
-          break;
-        }
-      }
-      if (keywords[j] != NULL) { // if break reached:
-        prev_sep = 0;
-        continue;
-      }
+  lx->in_comment = malloc(lx->numstates);
+  if (lx->in_comment == NULL) die("malloc");
+  for (int st = 0; st < lx->numstates; st++)
+    lx->in_comment[st] = (lx->configs[st].mode == LEX_MODE_MLCOMMENT);
+
+  free(lx->configs);
+  free(lx->slots);
+  lx->configs = NULL;
+  lx->slots = NULL;
+  editorLexFindStops(lx);
+  s->lexer = lx;
+  return 0;
+}
+
+// Finds, for each state, the few bytes that leave it; all other bytes must keep the state w/o
+// repainting or starting a token, and share one class, so a run of them is painted in one go
+void editorLexFindStops(struct lexTable *lx) {
+  lx->nstops = malloc(lx->numstates);
+  lx->stops = malloc(sizeof(*lx->stops) * lx->numstates);
+  lx->skip_class = malloc(lx->numstates);
+  if (lx->nstops == NULL || lx->stops == NULL || lx->skip_class == NULL) die("malloc");
+
+  for (int st = 0; st < lx->numstates; st++) {
+    int n = 0;
+    int cls = -1;
+    for (int c = 0; c < 256 && n <= LEX_MAX_STOPS; c++) {
+      unsigned int t = lx->next[st * 256 + c];
+      int keeps = LEX_STATE(t) == (unsigned int)st && !(t & (LEX_FILL_MASK | LEX_BEGIN)) &&
+                  (cls == -1 || (int)LEX_CLASS(t) == cls);
+      if (keeps)
+        cls = LEX_CLASS(t);
+      else if (n++ < LEX_MAX_STOPS)
+        lx->stops[st][n - 1] = c;
     }
+    lx->nstops[st] = n;
+    lx->skip_class[st] = (cls == -1) ? LEX_NORMAL : cls;
+  }
+}
 
-    prev_sep = is_separator(c);
-    i++;
+// Returns how many of the len bytes at p come before the first of the nstops bytes in stops
+// Scans 16 bytes at a time where SSE2 is available
+int editorLexSkip(const char *p, int len, const unsigned char *stops, int nstops) {
+  if (nstops == 0) return len;
+  if (nstops == 1) {
+    const char *hit = memchr(p, stops[0], len);
+    return hit ? hit - p : len;
   }
 
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if (changed && row->idx + 1 < E.numrows)
-    editorUpdateSyntax(&E.row[row->idx + 1]);
+  int i = 0;
+#ifdef __SSE2__
+  // Unused compares repeat stops[0]
+  __m128i s0 = _mm_set1_epi8(stops[0]);
+  __m128i s1 = _mm_set1_epi8(stops[1]);
+  __m128i s2 = _mm_set1_epi8(stops[nstops > 2 ? 2 : 0]);
+  __m128i s3 = _mm_set1_epi8(stops[nstops > 3 ? 3 : 0]);
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, s0), _mm_cmpeq_epi8(v, s1)),
+                                _mm_or_si128(_mm_cmpeq_epi8(v, s2), _mm_cmpeq_epi8(v, s3)));
+    int mask = _mm_movemask_epi8(hits);
+    if (mask) return i + __builtin_ctz(mask);
+  }
+#endif
+  for (; i < len; i++)
+    for (int k = 0; k < nstops; k++)
+      if ((unsigned char)p[i] == stops[k]) return i;
+  return len;
 }
 
-void editorSelectSyntaxHighlight() {
-  E.syntax = NULL;
-  if (E.filename == NULL) return;
-
-  char *ext = strrchr(E.filename, '.'); // returns pointer to last '.' in filename
+// Repaints the bytes a transition settled: the fill length before i, or from the token start
+void editorLexFill(unsigned char *hl, int i, int token, unsigned int t) {
+  int from = (LEX_FILL_LEN(t) == LEX_FILL_TOKEN) ? token : i - LEX_FILL_LEN(t);
+  memset(&hl[from], lex_class_hl[LEX_FILL_CLASS(t)], i - from);
+}
 
-  for (unsigned int j=0; j < HLDB_ENTRIES; j++) {
-    struct editorSyntax *s = &HLDB[j];
-    for (unsigned int i = 0; s->filematch[i]; i++) {
-      int is_ext = (s->filematch[i][0] == '.');
+// Highlights one rendered line into hl (rsize bytes) w/ compiled syntax lx, starting inside a
+// multiline comment if in_comment; returns whether the line leaves a multiline comment open
+// Only reads lx, so the highlight worker calls it too
+int editorLexLine(struct lexTable *lx, char *render, int rsize, unsigned char *hl, int in_comment) {
+  unsigned int *next = lx->next;
+  unsigned int state = in_comment ? lx->comment_start : lx->start;
+  int token = 0; // start of the word being read
+
+  for (int i = 0; i < rsize; i++) {
+    // Comments and strings: jump to the next byte that can end them
+    if (lx->nstops[state] <= LEX_MAX_STOPS) {
+      int run = editorLexSkip(render + i, rsize - i, lx->stops[state], lx->nstops[state]);
+      memset(&hl[i], lex_class_hl[lx->skip_class[state]], run);
+      i += run;
+      if (i == rsize) break;
+    }
+    unsigned int t = next[state * 256 + (unsigned char)render[i]];
+    if (t & LEX_FILL_MASK) editorLexFill(hl, i, token, t);
+    if (t & LEX_BEGIN) token = i;
+    hl[i] = lex_class_hl[LEX_CLASS(t)];
+    state = LEX_STATE(t);
+  }
 
-      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-          (!is_ext && strstr(E.filename, s->filematch[i]))) {
-        E.syntax = s;
+  // The end of the line ends a word like a separator ('\0') would
+  unsigned int t = next[state * 256];
+  if (t & LEX_FILL_MASK) editorLexFill(hl, rsize, token, t);
 
-        // Apply new syntax highlighting style
-        for (int filerow = 0; filerow < E.numrows; filerow++)
-          editorUpdateSyntax(&E.row[filerow]);
+  return lx->in_comment[state];
+}
 
-        return;
-      }
-    }
+// Highlights one rendered line into hl (rsize bytes) w/ the current syntax, starting inside a multiline comment if in_comment
+// render need not be null-terminated (tab-free rows are highlighted straight from chars)
+// Returns whether the line leaves a multiline comment open
+int editorHighlightLine(char *render, int rsize, unsigned char *hl, int in_comment) {
+  if (E.syntax == NULL) {
+    memset(hl, HL_NORMAL, rsize);
+    return 0;
   }
+  return editorLexLine(E.syntax->lexer, render, rsize, hl, in_comment);
 }
 
-/*** ROW OPERATIONS ***/
+// Returns a shared byte-per-column highlight buffer of at least size bytes (valid until the next call)
+unsigned char *editorHighlightScratch(int size) {
+  static unsigned char *hl = NULL;
+  static int hlcap = 0;
 
-// Takes special chars ('\t') into account to translate from memory characters to rendered graphemes
-int editorRowCxToRx(erow *row, int cx) {
-  int rx = 0;
-  for (int j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t')
-      rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-    rx++;
-  } 
-  return rx;
+  if (size > hlcap) {
+    hlcap = size * 2;
+    hl = realloc(hl, hlcap);
+    if (hl == NULL) die("realloc");
+  }
+  return hl;
 }
 
-int editorRowRxToCx(erow *row, int rx) {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t')
-      cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-    cur_rx++;
+// Stores the rsize highlight bytes of hl as row->hl: one span per run of non-normal columns
+void editorRowSetSpans(erow *row, unsigned char *hl, int rsize) {
+  int n = 0;
+  for (int i = 0; i < rsize; i++)
+    if (hl[i] != HL_NORMAL && (i == 0 || hl[i-1] != hl[i])) n++;
 
-    if (cur_rx > rx) break;
+  if ((int)(n * sizeof(hlSpan)) > row->hlcap) {
+    editorArenaFree(row->hl, row->hlcap);
+    row->hl = editorArenaAlloc(n * sizeof(hlSpan), &row->hlcap);
   }
-  return cx;
+
+  n = 0;
+  for (int i = 0; i < rsize;) {
+    int start = i;
+    while (i < rsize && hl[i] == hl[start]) i++;
+    if (hl[start] == HL_NORMAL) continue;
+    row->hl[n].start = start;
+    row->hl[n].len = i - start;
+    row->hl[n].hl = hl[start];
+    n++;
+  }
+  row->nhl = n;
 }
 
-void editorUpdateRow(erow *row) {
-  int tabs = 0;
-  for (int j = 0; j < row->size; j++)
-    if (row->chars[j] == '\t') tabs++;
+// Stores highlighting computed for row (entered w/ in_comment, leaving open_comment) as its current hl
+void editorRowSetHighlight(erow *row, unsigned char *hl, int rsize, int in_comment, int open_comment) {
+  editorRowSetSpans(row, hl, rsize);
+  row->hl_open_comment = open_comment;
+  row->hl_prev_open_comment = in_comment;
+  row->flags &= ~ROW_HL_STALE;
+  editorRowSetCommentStale(row, 0);
+}
 
-  free(row->render);
-  row->render = malloc(row->size + tabs*(KILO_TAB_STOP-1) + 1); // assume each tab takes up max space
+// Recomputes row->hl from the row's rendered text, continuing the multiline comment left open by the previous row
+void editorUpdateSyntax(erow *row, int in_comment) {
+  int rsize;
+  char *render = editorRowRenderText(row, &rsize);
+  unsigned char *hl = editorHighlightScratch(rsize);
+  int open_comment = editorHighlightLine(render, rsize, hl, in_comment);
+  editorRowSetHighlight(row, hl, rsize, in_comment, open_comment);
+}
 
-  int idx = 0;
-  for (int j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      // Write each tab as spaces up to the next tab stop
-      row->render[idx++] = ' ';
-      while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
-    } else
-      row->render[idx++] = row->chars[j];
+// Sets or clears ROW_COMMENT_STALE, keeping the stale count of the row's block (its checkpoint) in step
+void editorRowSetCommentStale(erow *row, int stale) {
+  if (!(row->flags & ROW_COMMENT_STALE) == !stale) return;
+  row->flags ^= ROW_COMMENT_STALE;
+  row->block->nstale += stale ? 1 : -1;
+}
+
+// Brings row's hl_open_comment up to date for entering state in_comment and returns it
+// Off-screen rows are rescanned w/o keeping hl; a row computed from this very state is left alone
+int editorRowSyncState(erow *row, int in_comment) {
+  if ((row->flags & ROW_COMMENT_STALE) || row->hl_prev_open_comment != in_comment) {
+    if (!(row->flags & ROW_RENDER_STALE))
+      editorUpdateSyntax(row, in_comment); // row is resident anyway: refresh its hl too
+    else {
+      row->hl_open_comment = editorScanCommentState(row, in_comment);
+      row->hl_prev_open_comment = in_comment;
+      editorRowSetCommentStale(row, 0);
+    }
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
+  return row->hl_open_comment;
+}
 
-  editorUpdateSyntax(row);
+// Returns whether row leaves a multiline comment open without storing its render/hl
+// Used to walk comment state past rows that aren't on screen
+int editorScanCommentState(erow *row, int in_comment) {
+  if (E.syntax == NULL || !E.syntax->multiline_comment_start || !E.syntax->multiline_comment_start[0]) return 0;
+
+  int rsize;
+  char *render = editorRowRenderText(row, &rsize);
+  return editorHighlightLine(render, rsize, editorHighlightScratch(rsize), in_comment);
 }
 
-// Inserts a row w/ given string "s" before current row "at"
-// If s is null, inserts a row w/ empty string
-void editorInsertRow(int at, char *s, size_t len) {
-  if (at < 0 || at > E.numrows) return;
+// Brings hl_open_comment up to date for every row before "at", spending at most E.hl_sync_budget steps
+// Returns whether it got there; if not, the rest is left pending for editorHighlightIdle()
+// Each row block is a checkpoint: a block w/o stale rows whose first row was computed from the state
+// the block is now entered with is still current as a whole, and is crossed in one step
+int editorSyncHighlightState(int at) {
+  if (E.hl_valid_rows >= at) return 1;
+
+  erow *row = editorRow(E.hl_valid_rows);
+  int in_comment = (E.hl_valid_rows > 0 && editorRow(E.hl_valid_rows - 1)->hl_open_comment);
+  while (E.hl_valid_rows < at) {
+    if (E.hl_sync_budget <= 0) return 0;
+    E.hl_sync_budget--;
+
+    struct rowBlock *block = row->block;
+    if (row == &block->rows[0] && block->nstale == 0 && row->hl_prev_open_comment == in_comment) {
+      erow *last = &block->rows[block->numrows - 1];
+      in_comment = last->hl_open_comment;
+      row = editorRowNext(last);
+      E.hl_valid_rows += block->numrows;
+      continue;
+    }
 
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows-at));
-  for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++; // fix index stored at each row
+    in_comment = editorRowSyncState(row, in_comment);
+    row = editorRowNext(row);
+    E.hl_valid_rows++;
+  }
+  return 1;
+}
 
-  E.row[at].idx = at;
+// Makes render and hl of row "at" current, building them only now that something needs them
+// If the rows above can't be caught up within the budget, only the rows of its block before it are
+// brought in line w/ the block's checkpoint (the state its first row was computed from), and
+// E.hl_pending asks editorHighlightIdle() to redraw once the real state is settled
+// Once the frame has highlighted HL_INLINE_BUDGET bytes, this row and the rest of the screen are
+// left to the highlight worker (editorHighlightDefer())
+erow *editorPrepareRow(int at) {
+  erow *row;
+  if (E.hl_deferring) {
+    // No catch-up here: it could highlight the deferred rows above inline
+    row = editorRow(at);
+    if (row->flags & ROW_RENDER_STALE)
+      editorRenderRow(row);
+    int in_comment = (at > 0 && editorRow(at - 1)->hl_open_comment);
+    if ((row->flags & ROW_HL_STALE) || row->hl_prev_open_comment != in_comment) {
+      row->flags |= ROW_HL_STALE;
+      editorHighlightDefer(row, at, in_comment);
+    }
+    return row;
+  }
 
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len+1);
-  if (s != NULL)
-    memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+  int synced = editorSyncHighlightState(at);
+  row = editorRow(at);
+  int in_comment;
+  if (synced)
+    in_comment = (at > 0 && editorRow(at - 1)->hl_open_comment);
+  else {
+    E.hl_pending = 1;
+    erow *r = &row->block->rows[0];
+    in_comment = r->hl_prev_open_comment;
+    for (; r < row; r++)
+      in_comment = editorRowSyncState(r, in_comment);
+  }
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = 0;
-  editorUpdateRow(&E.row[at]);
+  if (row->flags & ROW_RENDER_STALE)
+    editorRenderRow(row);
+  if ((row->flags & ROW_HL_STALE) || row->hl_prev_open_comment != in_comment) {
+    if (E.syntax && row->rsize > E.hl_inline_budget) {
+      E.hl_deferring = 1;
+      row->flags |= ROW_HL_STALE;
+      editorHighlightDefer(row, at, in_comment);
+      return row;
+    }
+    E.hl_inline_budget -= row->rsize;
+    int open_comment = row->hl_open_comment;
+    editorUpdateSyntax(row, in_comment);
+    // The next row was computed from the old state: keep its block checkpoint from vouching for it
+    erow *next = editorRowNext(row);
+    if (next && row->hl_open_comment != open_comment) editorRowSetCommentStale(next, 1);
+  }
+  if (synced && E.hl_valid_rows == at) E.hl_valid_rows++;
 
-  E.numrows++;
-  E.dirty = 1;
+  return row;
 }
 
-void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+// Runs one slice of the comment state catch-up while the editor waits for input
+// Returns whether there is more to do
+int editorHighlightIdle() {
+  E.hl_sync_budget = HL_IDLE_BUDGET;
+  editorSyncHighlightState(E.numrows);
+  if (E.hl_pending && (E.hl_valid_rows == E.numrows || E.hl_valid_rows >= E.rowoff + E.screenrows)) {
+    // Rows on screen were drawn w/ a guessed comment state
+    E.hl_pending = 0;
+    editorScheduleRefresh();
+  }
+  return E.hl_valid_rows < E.numrows;
 }
 
-// Deletes row 'at' and moves up all the following rows
-void editorDelRow(int at) {
-  if (at < 0 || at >= E.numrows) return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at+1], sizeof(erow) * (E.numrows - at - 1));
-  for (int j = at; j < E.numrows-1; j++) E.row[j].idx--; // fix index stored at each row
-  E.numrows--;
-  E.dirty = 1;
+// Highlight worker thread: highlights each posted batch from its snapshots, then signals done
+// If it runs out of memory it stops there; editorHighlightCollect() highlights the rows left w/o hl
+DWORD WINAPI editorHighlightWorker(LPVOID arg) {
+  struct hlWorker *w = arg;
+  while (1) {
+    WaitForSingleObject(w->work_event, INFINITE);
+    struct hlBatch *b = &w->batch;
+    int in_comment = 0;
+    for (int j = 0; j < b->numrows; j++) {
+      struct hlBatchRow *r = &b->rows[j];
+      r->hl = malloc(r->rsize + 1);
+      if (r->hl == NULL) break;
+      if (r->in_comment == -1) r->in_comment = in_comment;
+      in_comment = r->open_comment = editorLexLine(b->syntax->lexer, r->text, r->rsize, r->hl, r->in_comment);
+    }
+    InterlockedExchange(&w->done, 1);
+    SetEvent(w->done_event);
+  }
+  return 0;
 }
 
-// Inserts character into given row at given position.
-void editorRowInsertChar(erow *row, int at, char c) {
-  if (at < 0 || at > row->size) at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  editorUpdateRow(row);
-  E.dirty = 1;
+void editorHighlightWorkerStart() {
+  struct hlWorker *w = &E.hl_worker;
+  memset(w, 0, sizeof(*w));
+  w->work_event = CreateEvent(NULL, FALSE, FALSE, NULL); // auto-reset
+  w->done_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if (w->work_event == NULL || w->done_event == NULL) die("CreateEvent");
+  w->thread = CreateThread(NULL, 0, editorHighlightWorker, w, 0, NULL);
+  if (w->thread == NULL) die("CreateThread");
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty = 1;
+// Adds a snapshot of the stale row "at" to this frame's batch (in_comment: state entering it, which
+// the worker replaces w/ its own result when the row before is in the batch too)
+// The row is drawn w/o highlighting until editorHighlightCollect() applies the worker's result
+void editorHighlightDefer(erow *row, int at, int in_comment) {
+  struct hlWorker *w = &E.hl_worker;
+  row->nhl = 0;
+  // While a batch is in flight, the redraw after collecting it posts these rows
+  if (w->busy) return;
+
+  struct hlBatch *b = &w->batch;
+  if (b->numrows == 0)
+    b->syntax = E.syntax;
+  else if (b->rows[b->numrows - 1].at == at - 1)
+    in_comment = -1;
+  if (b->numrows == b->cap) {
+    b->cap = b->cap ? b->cap * 2 : 64;
+    b->rows = realloc(b->rows, sizeof(struct hlBatchRow) * b->cap);
+    if (b->rows == NULL) die("realloc");
+  }
+  struct hlBatchRow *r = &b->rows[b->numrows++];
+  int rsize;
+  char *render = editorRowRenderText(row, &rsize);
+  r->at = at;
+  r->version = row->version;
+  r->rsize = rsize;
+  r->in_comment = in_comment;
+  r->text = malloc(rsize + 1);
+  if (r->text == NULL) die("malloc");
+  memcpy(r->text, render, rsize);
+  r->hl = NULL;
 }
 
-// Deletes character at given space
-void editorRowDelChar(erow *row, int at) {
-  if (at < 0 || at >= row->size) return;
-  memmove(&row->chars[at], &row->chars[at+1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty = 1;
+// Hands the frame's batch to the worker
+void editorHighlightPost() {
+  struct hlWorker *w = &E.hl_worker;
+  if (w->busy || w->batch.numrows == 0) return;
+  w->busy = 1;
+  SetEvent(w->work_event);
 }
 
-/*** EDITOR OPERATIONS ***/
+// Applies the worker's finished batch to the rows that are still waiting for it and haven't changed
+// since their snapshot (same version); the rest is dropped. Rows the worker couldn't allocate hl
+// for are highlighted here. Returns whether a batch was collected
+int editorHighlightCollect() {
+  struct hlWorker *w = &E.hl_worker;
+  if (!w->busy || InterlockedCompareExchange(&w->done, 0, 1) != 1) return 0;
+
+  struct hlBatch *b = &w->batch;
+  for (int j = 0; j < b->numrows; j++) {
+    struct hlBatchRow *r = &b->rows[j];
+    erow *row = (r->at < E.numrows) ? editorRow(r->at) : NULL;
+    if (row && row->version == r->version && (row->flags & ROW_HL_STALE) && !(row->flags & ROW_RENDER_STALE)) {
+      int open_comment = row->hl_open_comment;
+      if (r->hl)
+        editorRowSetHighlight(row, r->hl, r->rsize, r->in_comment, r->open_comment);
+      else
+        editorUpdateSyntax(row, r->at > 0 && editorRow(r->at - 1)->hl_open_comment);
+      erow *next = editorRowNext(row);
+      if (next && row->hl_open_comment != open_comment) editorRowSetCommentStale(next, 1);
+    }
+    free(r->text);
+    free(r->hl);
+  }
+  b->numrows = 0;
+  w->busy = 0;
+  return 1;
+}
 
-// Replaces spacing (' ', '\t') of row_dst with that of row_src, returns number of space+tab chars
-int editorMatchSpaces(erow *row_src, erow *row_dst) {
-  // count spaces and tabs in src
-  int num_space_chars; // #' ' + #'\t'
-  for (num_space_chars=0; num_space_chars < row_src->size && (row_src->chars[num_space_chars]==' ' || row_src->chars[num_space_chars]=='\t'); num_space_chars++);
-  // if (num_space_chars == row_src->size && num_space_chars != 0) num_space_chars--;
-  // count spaces and tabs in dst
-  int num_space_chars_dst; // #' ' + #'\t'
-  for (num_space_chars_dst=0; num_space_chars_dst < row_dst->size && (row_dst->chars[num_space_chars_dst]==' ' || row_dst->chars[num_space_chars_dst]=='\t'); num_space_chars_dst++);
-  // if (num_space_chars_dst == row_dst->size && num_space_chars_dst != 0) num_space_chars_dst--;
+// Returns the first of the n syntaxes in db that matches E.filename, NULL if none does
+struct editorSyntax *editorFindSyntax(struct editorSyntax *db, int n) {
+  char *ext = strrchr(E.filename, '.'); // returns pointer to last '.' in filename
 
-  // create new dst such that it contains the spacing of row and the rest of dst
+  for (int j = 0; j < n; j++) {
+    struct editorSyntax *s = &db[j];
+    for (unsigned int i = 0; s->filematch && s->filematch[i]; i++) {
+      int is_ext = (s->filematch[i][0] == '.');
 
-  // This handles the new row being bigger or smaller than the old one
-  int new_row_size = row_dst->size - num_space_chars_dst + num_space_chars;
-  char *new_dst_row = malloc(new_row_size);
-  if (row_dst->size != num_space_chars_dst)
-    memcpy(&new_dst_row[num_space_chars], &row_dst->chars[num_space_chars_dst], row_dst->size-num_space_chars_dst);
-  if (num_space_chars)
-    memcpy(new_dst_row, row_src->chars, num_space_chars);
-  row_dst->size = new_row_size;
-  free(row_dst->chars);
-  row_dst->chars = new_dst_row;
+      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+          (!is_ext && strstr(E.filename, s->filematch[i])))
+        return s;
+    }
+  }
+  return NULL;
+}
 
-  return num_space_chars;
+void editorSelectSyntaxHighlight() {
+  E.syntax = NULL;
+  if (E.filename == NULL) return;
+
+  // Definitions from syntax files are searched first, so they can override the built-in ones
+  struct editorSyntax *s = editorFindSyntax(E.syntaxdb, E.syntaxdb_len);
+  if (s == NULL) s = editorFindSyntax(HLDB, HLDB_ENTRIES);
+  if (s == NULL) return;
+
+  if (s->lexer == NULL && editorCompileSyntax(s) == -1) return;
+  E.syntax = s;
+
+  // Apply new syntax highlighting style as rows get drawn
+  for (erow *row = editorRowFirst(); row; row = editorRowNext(row)) {
+    row->flags |= ROW_HL_STALE;
+    row->version = ++E.row_version; // worker results for the old syntax no longer apply
+    editorRowSetCommentStale(row, 1);
+  }
+  E.hl_valid_rows = 0;
 }
 
-// Inserts character at cursors. If on line past EOF, it creates a new row.
-void editorInsertChar(char c, int record_undo_event) {
-  if (E.cy == E.numrows) {
-    editorInsertRow(E.numrows, "", 0); // append row at end
+/*** SYNTAX FILES ***/
+
+// Returns the NULL terminated list w/ a copy of s appended
+char **editorSyntaxListAppend(char **list, char *s) {
+  int n = 0;
+  while (list && list[n]) n++;
+  list = realloc(list, sizeof(char *) * (n + 2));
+  if (list == NULL) die("realloc");
+  list[n] = strdup(s);
+  list[n + 1] = NULL;
+  return list;
+}
+
+// Frees the NULL terminated list made by editorSyntaxListAppend()
+void editorSyntaxListFree(char **list) {
+  for (int n = 0; list && list[n]; n++)
+    free(list[n]);
+  free(list);
+}
+
+// Compiles the definition just read from a syntax file (the last one in E.syntaxdb)
+// A definition too big to compile is dropped, so its files are left unhighlighted
+// Returns an error message, or NULL if the definition was fine
+char *editorSyntaxFileEnd() {
+  struct editorSyntax *s = &E.syntaxdb[E.syntaxdb_len - 1];
+  if (editorCompileSyntax(s) == 0) return NULL;
+
+  free(s->filetype);
+  editorSyntaxListFree(s->filematch);
+  editorSyntaxListFree(s->keywords);
+  free(s->singleline_comment_start);
+  free(s->multiline_comment_start);
+  free(s->multiline_comment_end);
+  editorSyntaxListFree(s->hex_prefixes);
+  editorSyntaxListFree(s->bin_prefixes);
+  if (s->keyword_trie) {
+    free(s->keyword_trie->nodes);
+    free(s->keyword_trie);
   }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  if (record_undo_event)
-    addUndoEvent(EVENT_INSERT_CHAR, E.cy, E.cx, &c, 1);
-  E.cx++;
+  E.syntaxdb_len--;
+  return "syntax too large";
 }
 
-void editorInsertNewline(int match_spaces, int record_undo_event) {
-  if (E.cx == 0)
-    editorInsertRow(E.cy, "", 0); // just insert new line
-  else {
-    // insert new line with everything from cx onward on it
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+// Applies the "key args" line of a syntax file to s
+// Returns an error message, or NULL if the line was fine
+char *editorSyntaxFileLine(struct editorSyntax *s, char *key, char *args) {
+  char *words[LEX_MAX_DELIM];
+  int nwords = 0;
+  int is_list = !strcmp(key, "files") || !strcmp(key, "keywords") || !strcmp(key, "types");
+
+  for (char *w = strtok(args, " \t"); w; w = strtok(NULL, " \t")) {
+    if (is_list) {
+      if (strcmp(key, "files")) {
+        for (char *p = w; *p; p++)
+          if (is_separator(*p)) return "keywords can't contain separators";
+      }
+      if (!strcmp(key, "types")) {
+        char kw2[256];
+        snprintf(kw2, sizeof(kw2), "%s|", w); // KEYWORD2 words end in | like in HLDB
+        s->keywords = editorSyntaxListAppend(s->keywords, kw2);
+      } else if (!strcmp(key, "keywords"))
+        s->keywords = editorSyntaxListAppend(s->keywords, w);
+      else
+        s->filematch = editorSyntaxListAppend(s->filematch, w);
+      continue;
+    }
+    if (nwords == LEX_MAX_DELIM) return "too many values";
+    words[nwords++] = w;
   }
-  if (match_spaces) {
-    int spaces = editorMatchSpaces(&E.row[E.cy], &E.row[E.cy+1]);
-    editorUpdateRow(&E.row[E.cy+1]);
-    E.cx = spaces;
-  } else {
-    E.cx = 0;
+  if (is_list) return NULL;
+
+  if (!strcmp(key, "comment") || !strcmp(key, "multiline")) {
+    int multiline = !strcmp(key, "multiline");
+    if (nwords != (multiline ? 2 : 1)) return multiline ? "expected start and end strings" : "expected one string";
+    for (int j = 0; j < nwords; j++)
+      if (strlen(words[j]) > LEX_MAX_DELIM) return "comment delimiter too long";
+    if (multiline) {
+      s->multiline_comment_start = strdup(words[0]);
+      s->multiline_comment_end = strdup(words[1]);
+    } else
+      s->singleline_comment_start = strdup(words[0]);
+    return NULL;
   }
-  E.cy++;
 
-  if (record_undo_event) {
-    // Coordinates are on new line after spaces
-    addUndoEvent(EVENT_INSERT_NEWLINE, E.cy, E.cx, E.row[E.cy].chars, E.cx);
+  if (!strcmp(key, "hex") || !strcmp(key, "binary")) {
+    for (int j = 0; j < nwords; j++) {
+      char *w = words[j];
+      int symbol = !isalnum((unsigned char)w[0]) && w[1] == '\0';
+      int zero = w[0] == '0' && isalpha((unsigned char)w[1]) && w[2] == '\0';
+      if (!symbol && !zero) return "number prefixes are one symbol or 0 and a letter";
+      if (key[0] == 'h') s->hex_prefixes = editorSyntaxListAppend(s->hex_prefixes, w);
+      else s->bin_prefixes = editorSyntaxListAppend(s->bin_prefixes, w);
+    }
+    return NULL;
   }
 
+  if (nwords) return "unexpected value";
+  if (!strcmp(key, "numbers")) s->flags |= HL_HIGHLIGHT_NUMBERS;
+  else if (!strcmp(key, "strings")) s->flags |= HL_HIGHLIGHT_STRINGS;
+  else if (!strcmp(key, "nocase")) s->flags |= HL_NOCASE;
+  else if (!strcmp(key, "labels")) s->flags |= HL_LABELS;
+  else return "unknown key";
+  return NULL;
 }
 
-// Deletes character left of cursor (backspace)
-void editorDelChar(int record_undo_event) {
-  if (E.cy == E.numrows) return;
-  if (E.cx == 0 && E.cy == 0) return;
-
-  if (record_undo_event) {
-    if (E.cx > 0)
-      addUndoEvent(EVENT_DELETE_CHAR, E.cy, E.cx-1, &E.row[E.cy].chars[E.cx-1], 1);
+// Adds the syntax definitions in the file at path to E.syntaxdb (a missing file is skipped)
+// Each definition starts w/ "syntax <name>"; the first bad line is reported in the status bar
+// Definitions are compiled as soon as they are read (see editorSyntaxFileEnd())
+void editorLoadSyntaxFile(const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) return;
+
+  struct editorSyntax *s = NULL;
+  int lineno = 0;
+  int s_lineno = 0; // line of the "syntax" line that started s
+  int reported = 0;
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    lineno++;
+    while (linelen > 0 && isspace((unsigned char)line[linelen-1]))
+      line[--linelen] = '\0';
+
+    // Split off the key; blank lines and lines starting w/ '#' are skipped
+    char *key = line;
+    while (isspace((unsigned char)*key)) key++;
+    if (*key == '\0' || *key == '#') continue;
+    char *args = key;
+    while (*args && !isspace((unsigned char)*args)) args++;
+    if (*args) *args++ = '\0';
+    while (isspace((unsigned char)*args)) args++;
+
+    char *err = NULL;
+    if (!strcmp(key, "syntax")) {
+      // The previous definition is complete: compile it
+      char *end_err = s ? editorSyntaxFileEnd() : NULL;
+      if (end_err && !reported) {
+        editorSetStatusMessage("%s:%d: %s", path, s_lineno, end_err);
+        reported = 1;
+      }
+      s = NULL;
+      if (*args == '\0')
+        err = "syntax needs a name";
+      else {
+        s_lineno = lineno;
+        E.syntaxdb = realloc(E.syntaxdb, sizeof(struct editorSyntax) * (E.syntaxdb_len + 1));
+        if (E.syntaxdb == NULL) die("realloc");
+        s = &E.syntaxdb[E.syntaxdb_len++];
+        memset(s, 0, sizeof(*s));
+        s->filetype = strdup(args);
+      }
+    } else if (s == NULL)
+      err = "expected \"syntax <name>\" first";
     else
-      addUndoEvent(EVENT_DELETE_CHAR, E.cy-1, E.row[E.cy-1].size, "\n", 1);
+      err = editorSyntaxFileLine(s, key, args);
+
+    if (err && !reported) {
+      editorSetStatusMessage("%s:%d: %s", path, lineno, err);
+      reported = 1;
+    }
   }
+  free(line);
+  fclose(fp);
+  char *end_err = s ? editorSyntaxFileEnd() : NULL;
+  if (end_err && !reported)
+    editorSetStatusMessage("%s:%d: %s", path, s_lineno, end_err);
+}
 
-  erow *row = &E.row[E.cy];
-  if (E.cx > 0)
-    editorRowDelChar(row, --E.cx);
-  else {
-    // Delete line and move data to previous line
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-    editorDelRow(E.cy--);
+/*** ROW ARENA ***/
+
+// Size class of a buffer of size bytes, or ARENA_NUM_CLASSES if it is too big for a class
+int editorArenaClass(int size) {
+  int c = 0;
+  int classsize = ARENA_MIN_CLASS;
+  while (classsize < size && c < ARENA_NUM_CLASSES) {
+    classsize *= 2;
+    c++;
+  }
+  return c;
+}
+
+// Bytes actually granted for a request of size bytes
+int editorArenaClassSize(int size) {
+  int c = editorArenaClass(size);
+  return c < ARENA_NUM_CLASSES ? ARENA_MIN_CLASS << c : size;
+}
+
+// Returns a buffer of at least size bytes and sets cap to its real size
+// Pass the same cap back to editorArenaFree()/editorArenaRealloc()
+void *editorArenaAlloc(int size, int *cap) {
+  struct rowArena *a = &E.arena;
+  int c = editorArenaClass(size);
+  a->allocs++;
+
+  if (c == ARENA_NUM_CLASSES) {
+    struct arenaLarge *l = malloc(sizeof(struct arenaLarge) + size);
+    if (l == NULL) die("malloc");
+    l->prev = NULL;
+    l->next = a->large;
+    if (a->large) a->large->prev = l;
+    a->large = l;
+    a->heap_allocs++;
+    a->bytes_in_use += size;
+    *cap = size;
+    return l + 1;
+  }
+
+  int classsize = ARENA_MIN_CLASS << c;
+  void *p = a->freelist[c];
+  if (p) {
+    a->freelist[c] = *(void **)p;
+  } else {
+    if (a->bump_end - a->bump < classsize) {
+      // The tail of the old slab is dropped: it is smaller than the largest class
+      struct arenaSlab *slab = malloc(sizeof(struct arenaSlab) + ARENA_SLAB_SIZE);
+      if (slab == NULL) die("malloc");
+      slab->next = a->slabs;
+      a->slabs = slab;
+      a->bump = (char *)(slab + 1);
+      a->bump_end = a->bump + ARENA_SLAB_SIZE;
+      a->heap_allocs++;
+      a->slabs_count++;
+    }
+    p = a->bump;
+    a->bump += classsize;
+  }
+  a->bytes_in_use += classsize;
+  *cap = classsize;
+  return p;
+}
+
+// Gives a buffer back to its size class (cap as set by editorArenaAlloc())
+void editorArenaFree(void *p, int cap) {
+  if (p == NULL) return;
+  struct rowArena *a = &E.arena;
+  a->frees++;
+  a->bytes_in_use -= cap;
+
+  int c = editorArenaClass(cap);
+  if (c == ARENA_NUM_CLASSES) {
+    struct arenaLarge *l = (struct arenaLarge *)p - 1;
+    if (l->prev) l->prev->next = l->next;
+    else a->large = l->next;
+    if (l->next) l->next->prev = l->prev;
+    free(l);
+    return;
+  }
+  *(void **)p = a->freelist[c];
+  a->freelist[c] = p;
+}
+
+// Grows p to at least size bytes, in place when it already fits or when it is the newest
+// buffer of the current slab and can take over the slab's unused tail
+void *editorArenaRealloc(void *p, int oldcap, int size, int *cap) {
+  struct rowArena *a = &E.arena;
+  if (p != NULL && size <= oldcap) {
+    *cap = oldcap;
+    return p;
+  }
+  int c = editorArenaClass(size);
+  if (p != NULL && c < ARENA_NUM_CLASSES && (char *)p + oldcap == a->bump &&
+      a->bump_end - (char *)p >= (ARENA_MIN_CLASS << c)) {
+    *cap = ARENA_MIN_CLASS << c;
+    a->bump = (char *)p + *cap;
+    a->bytes_in_use += *cap - oldcap;
+    a->grows_in_place++;
+    return p;
+  }
+  void *np = editorArenaAlloc(size, cap);
+  if (p != NULL) {
+    memcpy(np, p, oldcap);
+    editorArenaFree(p, oldcap);
+  }
+  return np;
+}
+
+// Releases every row buffer at once: one free per slab instead of one per buffer
+void editorArenaReset() {
+  struct rowArena *a = &E.arena;
+  while (a->slabs) {
+    struct arenaSlab *next = a->slabs->next;
+    free(a->slabs);
+    a->slabs = next;
+  }
+  while (a->large) {
+    struct arenaLarge *next = a->large->next;
+    free(a->large);
+    a->large = next;
+  }
+  a->bump = a->bump_end = NULL;
+  memset(a->freelist, 0, sizeof(a->freelist));
+  a->bytes_in_use = 0;
+}
+
+// Shows the arena counters in the status bar
+void editorArenaStats() {
+  struct rowArena *a = &E.arena;
+  editorSetStatusMessage("Rows: %ld alloc %ld free %ld in place | %ld malloc %ld slab %ldKB",
+    a->allocs, a->frees, a->grows_in_place, a->heap_allocs, a->slabs_count, a->bytes_in_use / 1024);
+}
+
+/*** ROW TREE ***/
+
+// Rows live in fixed-size blocks; a Fenwick tree over the block sizes (E.blockcounts) turns a
+// line number into a block + offset in O(log blocks), so inserting or deleting a row never
+// renumbers the rows after it
+
+// Number of rows in the blocks before block b
+int editorBlockPrefix(int b) {
+  int sum = 0;
+  for (int i = b; i > 0; i -= i & -i)
+    sum += E.blockcounts[i];
+  return sum;
+}
+
+// Adds delta to the row count of block b
+void editorBlockCountAdd(int b, int delta) {
+  for (int i = b + 1; i <= E.numblocks; i += i & -i)
+    E.blockcounts[i] += delta;
+}
+
+// Returns the block holding row "at" and sets off to the row's position in it
+// at == E.numrows maps to the end of the last block
+int editorBlockFind(int at, int *off) {
+  if (at >= E.numrows) {
+    int b = E.numblocks - 1;
+    *off = E.blocks[b]->numrows;
+    return b;
+  }
+  int pos = 0;
+  int step = 1;
+  while (step * 2 <= E.numblocks) step *= 2;
+  for (; step; step /= 2) {
+    if (pos + step <= E.numblocks && E.blockcounts[pos + step] <= at) {
+      pos += step;
+      at -= E.blockcounts[pos];
+    }
+  }
+  *off = at;
+  return pos;
+}
+
+// Returns row "at" (0 <= at < E.numrows)
+// The pointer is invalidated by the next row insertion or deletion
+erow *editorRow(int at) {
+  int off;
+  int b = editorBlockFind(at, &off);
+  return &E.blocks[b]->rows[off];
+}
+
+// Returns the line number of row
+int editorRowIndex(erow *row) {
+  return editorBlockPrefix(row->block->index) + (int)(row - row->block->rows);
+}
+
+// Returns the first row, or NULL when the buffer is empty
+erow *editorRowFirst() {
+  return E.numrows ? editorRow(0) : NULL;
+}
+
+// Returns the row after row, or NULL after the last row
+erow *editorRowNext(erow *row) {
+  struct rowBlock *block = row->block;
+  if (row + 1 < &block->rows[block->numrows]) return row + 1;
+  for (int b = block->index + 1; b < E.numblocks; b++)
+    if (E.blocks[b]->numrows) return &E.blocks[b]->rows[0];
+  return NULL;
+}
+
+// Inserts n empty blocks before block "at" (callers fill them and call editorRowTreeRebuild())
+void editorInsertBlocks(int at, int n) {
+  if (E.numblocks + n > E.blockcap) {
+    int cap = E.blockcap ? E.blockcap : 16;
+    while (cap < E.numblocks + n) cap *= 2;
+    E.blocks = realloc(E.blocks, sizeof(struct rowBlock *) * cap);
+    E.blockcounts = realloc(E.blockcounts, sizeof(int) * (cap + 1));
+    if (E.blocks == NULL || E.blockcounts == NULL) die("realloc");
+    E.blockcap = cap;
+  }
+  memmove(&E.blocks[at + n], &E.blocks[at], sizeof(struct rowBlock *) * (E.numblocks - at));
+  for (int b = at; b < at + n; b++) {
+    E.blocks[b] = malloc(sizeof(struct rowBlock));
+    if (E.blocks[b] == NULL) die("malloc");
+    E.blocks[b]->numrows = 0;
+    E.blocks[b]->nstale = 0;
+    E.blocks[b]->index = b;
+  }
+  E.numblocks += n;
+}
+
+// Drops empty blocks, renumbers blocks and rebuilds the Fenwick tree in O(blocks)
+void editorRowTreeRebuild() {
+  int kept = 0;
+  for (int b = 0; b < E.numblocks; b++) {
+    if (E.blocks[b]->numrows == 0) {
+      free(E.blocks[b]);
+      continue;
+    }
+    E.blocks[kept] = E.blocks[b];
+    E.blocks[kept]->index = kept;
+    kept++;
+  }
+  E.numblocks = kept;
+
+  for (int i = 1; i <= E.numblocks; i++)
+    E.blockcounts[i] = E.blocks[i-1]->numrows;
+  for (int i = 1; i <= E.numblocks; i++) {
+    int parent = i + (i & -i);
+    if (parent <= E.numblocks) E.blockcounts[parent] += E.blockcounts[i];
+  }
+}
+
+/*** ROW OPERATIONS ***/
+
+// Returns whether row contains tabs; the answer is cached in the row flags until the row is edited
+int editorRowHasTabs(erow *row) {
+  if (!(row->flags & ROW_TABS_KNOWN)) {
+    int tail = row->size - row->gap; // chars after the gap
+    int tabs = (row->gap > 0 && memchr(row->chars, '\t', row->gap)) ||
+               (tail > 0 && memchr(&row->chars[row->cap - tail], '\t', tail));
+    row->flags |= ROW_TABS_KNOWN | (tabs ? ROW_HAS_TABS : 0);
+  }
+  return row->flags & ROW_HAS_TABS;
+}
+
+// Takes special chars ('\t') into account to translate from memory characters to rendered graphemes
+int editorRowCxToRx(erow *row, int cx) {
+  if (!editorRowHasTabs(row)) return cx;
+  int rx = 0;
+  for (int j = 0; j < cx; j++) {
+    if (ROW_CHAR(row, j) == '\t')
+      rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+    rx++;
+  } 
+  return rx;
+}
+
+int editorRowRxToCx(erow *row, int rx) {
+  if (!editorRowHasTabs(row)) return rx < row->size ? rx : row->size;
+  int cur_rx = 0;
+  int cx;
+  for (cx = 0; cx < row->size; cx++) {
+    if (ROW_CHAR(row, cx) == '\t')
+      cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
+    cur_rx++;
+
+    if (cur_rx > rx) break;
+  }
+  return cx;
+}
+
+// Upper bound on the rendered length of row->chars from index "from" on (assume each tab takes up max space)
+int editorRowMaxRenderLen(erow *row, int from) {
+  if (!editorRowHasTabs(row)) return row->size - from;
+  int tabs = 0;
+  for (int j = from; j < row->size; j++)
+    if (ROW_CHAR(row, j) == '\t') tabs++;
+  return row->size - from + tabs*(KILO_TAB_STOP-1);
+}
+
+// Writes row->chars from index "from" on into dst w/ tabs expanded, null-terminated
+// Output starts at dst[rx], where rx is the rendered column of "from"; returns the rendered length
+// dst must hold rx + editorRowMaxRenderLen(row, from) + 1 bytes
+int editorRowExpandTabs(erow *row, int from, int rx, char *dst) {
+  int idx = rx;
+  for (int j = from; j < row->size; j++) {
+    char c = ROW_CHAR(row, j);
+    if (c == '\t') {
+      // Write each tab as spaces up to the next tab stop
+      dst[idx++] = ' ';
+      while (idx % KILO_TAB_STOP != 0) dst[idx++] = ' ';
+    } else
+      dst[idx++] = c;
+  }
+  dst[idx] = '\0';
+  return idx;
+}
+
+// Rebuilds row->render from row->chars; hl must be recomputed afterwards
+// Render before the first edited char is still valid, so only the rest is expanded again
+// In render-free mode only rsize is set (see editorRowRenderText())
+void editorRenderRow(erow *row) {
+  if (E.render_free) {
+    row->rsize = editorRowCxToRx(row, row->size);
+    row->flags = (row->flags & ~ROW_RENDER_STALE) | ROW_HL_STALE;
+    return;
+  }
+
+  int from = row->render ? row->render_from : 0;
+  if (from > row->size) from = row->size;
+  int rx = editorRowCxToRx(row, from);
+
+  // render grows geometrically, so typing doesn't realloc it
+  int need = rx + editorRowMaxRenderLen(row, from) + 1;
+  if (need > row->rcap)
+    row->render = editorArenaRealloc(row->render, row->rcap, need * 2, &row->rcap);
+  row->rsize = editorRowExpandTabs(row, from, rx, row->render);
+  row->render_from = row->size;
+  row->flags = (row->flags & ~ROW_RENDER_STALE) | ROW_HL_STALE;
+}
+
+// Renders row into a shared scratch buffer (valid until the next call) without touching the row
+// (a tab-free row is just its two runs around the gap put back together)
+char *editorRenderScratch(erow *row, int *rsize) {
+  static char *buf = NULL;
+  static int bufcap = 0;
+
+  int len = editorRowMaxRenderLen(row, 0) + 1;
+  if (len > bufcap) {
+    bufcap = len * 2;
+    buf = realloc(buf, bufcap);
+    if (buf == NULL) die("realloc");
+  }
+  if (!editorRowHasTabs(row)) {
+    int tail = row->size - row->gap;
+    if (row->gap) memcpy(buf, row->chars, row->gap);
+    if (tail) memcpy(&buf[row->gap], &row->chars[row->cap - tail], tail);
+    buf[row->size] = '\0';
+    *rsize = row->size;
+  } else
+    *rsize = editorRowExpandTabs(row, 0, 0, buf);
+  return buf;
+}
+
+// Returns the rendered text of row (not null-terminated) and sets rsize
+// Tab-free rows are their own render; rows w/ tabs use the stored render, or in render-free mode
+// (or while it is stale) a scratch expansion that is valid until the next call
+// The gap is never closed here: a row being typed into is read through the scratch buffer instead,
+// so redrawing it after each keystroke doesn't move its tail
+char *editorRowRenderText(erow *row, int *rsize) {
+  if (!editorRowHasTabs(row) && row->gap == row->size) {
+    *rsize = row->size;
+    return row->size ? row->chars : "";
+  }
+  if (row->render && !(row->flags & ROW_RENDER_STALE)) {
+    *rsize = row->rsize;
+    return row->render;
+  }
+  return editorRenderScratch(row, rsize);
+}
+
+// Marks row as edited from chars index "at" on: render and hl are rebuilt by editorPrepareRow() once needed
+void editorUpdateRowFrom(erow *row, int at) {
+  if (at < row->render_from) row->render_from = at;
+  row->flags = (row->flags | ROW_RENDER_STALE | ROW_HL_STALE) & ~(ROW_TABS_KNOWN | ROW_HAS_TABS);
+  row->version = ++E.row_version;
+  editorRowSetCommentStale(row, 1);
+  if (E.find.query) editorFindUpdateRow(row);
+  if (E.hl_valid_rows > 0) {
+    int idx = editorRowIndex(row);
+    if (idx < E.hl_valid_rows) E.hl_valid_rows = idx;
+  }
+}
+
+// Marks the whole row as edited
+void editorUpdateRow(erow *row) {
+  editorUpdateRowFrom(row, 0);
+}
+
+// Frees render and hl of a row nobody is looking at; they are rebuilt on demand
+void editorEvictRow(erow *row) {
+  editorArenaFree(row->render, row->rcap);
+  editorArenaFree(row->hl, row->hlcap);
+  row->render = NULL;
+  row->hl = NULL;
+  row->nhl = 0;
+  row->rsize = 0;
+  row->rcap = 0;
+  row->hlcap = 0;
+  row->flags |= ROW_RENDER_STALE | ROW_HL_STALE;
+}
+
+// Sets up n empty rows (render/hl stale) at rows[at] of block
+void editorInitRows(struct rowBlock *block, int at, int n) {
+  for (int j = at; j < at + n; j++) {
+    erow *row = &block->rows[j];
+    row->block = block;
+    row->size = 0;
+    row->chars = NULL;
+    row->cap = 0;
+    row->gap = 0;
+    row->flags = ROW_RENDER_STALE | ROW_HL_STALE | ROW_COMMENT_STALE;
+    row->rsize = 0;
+    row->rcap = 0;
+    row->render_from = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->nhl = 0;
+    row->hlcap = 0;
+    row->hl_open_comment = 0;
+    row->hl_prev_open_comment = 0;
+    row->version = ++E.row_version;
+  }
+  block->nstale += n;
+}
+
+// Splices n empty rows in before row "at"; callers fill in chars/size through editorRow()
+// Only the block holding "at" is touched, unless it overflows: then it is split and the
+// new rows plus the rest of the block go into fresh blocks (one pass for any n)
+void editorInsertRows(int at, int n) {
+  if (at < 0 || at > E.numrows || n <= 0) return;
+
+  if (E.numblocks == 0) {
+    editorInsertBlocks(0, 1);
+    E.blockcounts[1] = 0;
+  }
+  int off;
+  int b = editorBlockFind(at, &off);
+  struct rowBlock *block = E.blocks[b];
+
+  if (block->numrows + n <= ROWBLOCK_MAX) {
+    memmove(&block->rows[off + n], &block->rows[off], sizeof(erow) * (block->numrows - off));
+    editorInitRows(block, off, n);
+    block->numrows += n;
+    editorBlockCountAdd(b, n);
+  } else {
+    int tail = block->numrows - off;
+    int total = n + tail;
+    int newblocks = (total + ROWBLOCK_FILL - 1) / ROWBLOCK_FILL;
+    editorInsertBlocks(b + 1, newblocks);
+    block = E.blocks[b];
+
+    int placed = 0;
+    for (int k = 0; k < newblocks; k++) {
+      struct rowBlock *nb = E.blocks[b + 1 + k];
+      int cnt = total - placed < ROWBLOCK_FILL ? total - placed : ROWBLOCK_FILL;
+      for (int j = 0; j < cnt; j++, placed++) {
+        if (placed < n) {
+          editorInitRows(nb, j, 1);
+        } else {
+          nb->rows[j] = block->rows[off + placed - n];
+          nb->rows[j].block = nb;
+          if (nb->rows[j].flags & ROW_COMMENT_STALE) {
+            nb->nstale++;
+            block->nstale--;
+          }
+        }
+      }
+      nb->numrows = cnt;
+    }
+    block->numrows = off;
+    editorRowTreeRebuild();
+  }
+
+  E.numrows += n;
+  if (E.find.query) editorFindShiftRows(at, n);
+  if (at < E.hl_valid_rows) E.hl_valid_rows = at;
+  if (at + n < E.numrows) editorRowSetCommentStale(editorRow(at + n), 1); // has a new predecessor
+  E.dirty = 1;
+}
+
+// Inserts a row before current row "at" that takes the given chars buffer as-is
+// chars must come from editorArenaAlloc(len+1, ...)
+// With ROW_CHARS_VIEW, chars is borrowed from E.viewbuf and copied on first edit
+void editorInsertRowChars(int at, char *chars, size_t len, int flags) {
+  if (at < 0 || at > E.numrows) return;
+  editorInsertRows(at, 1);
+  erow *row = editorRow(at);
+
+  row->size = len;
+  row->chars = chars;
+  row->cap = (flags & ROW_CHARS_VIEW) ? 0 : editorArenaClassSize(len + 1); // owned buffers come with a null terminator
+  row->gap = len;
+  row->flags |= flags;
+  editorUpdateRow(row);
+}
+
+// Inserts a row w/ given string "s" before current row "at"
+// If s is null, inserts a row w/ empty string
+void editorInsertRow(int at, char *s, size_t len) {
+  if (at < 0 || at > E.numrows) return;
+
+  int cap;
+  char *chars = editorArenaAlloc(len+1, &cap);
+  if (s != NULL)
+    memcpy(chars, s, len);
+  chars[len] = '\0';
+  editorInsertRowChars(at, chars, len, 0);
+}
+
+void editorFreeRow(erow *row) {
+  editorArenaFree(row->render, row->rcap);
+  if (!(row->flags & ROW_CHARS_VIEW))
+    editorArenaFree(row->chars, row->cap);
+  editorArenaFree(row->hl, row->hlcap);
+}
+
+// Gives a view row its own (writable, null-terminated) copy of its chars
+// Must be called before anything writes to or reallocs row->chars
+void editorRowMaterialize(erow *row) {
+  if (!(row->flags & ROW_CHARS_VIEW)) return;
+  int cap;
+  char *chars = editorArenaAlloc(row->size + 1, &cap);
+  memcpy(chars, row->chars, row->size);
+  chars[row->size] = '\0';
+  row->chars = chars;
+  row->cap = cap;
+  row->gap = row->size;
+  row->flags &= ~ROW_CHARS_VIEW;
+}
+
+// Grows an owned row's buffer to at least mincap bytes, keeping the gap in place
+void editorRowGrow(erow *row, int mincap) {
+  if (mincap <= row->cap) return;
+  int newcap = row->cap * 2 > mincap ? row->cap * 2 : mincap;
+  if (newcap < ROW_MIN_CAP) newcap = ROW_MIN_CAP;
+
+  int tail = row->size - row->gap; // chars after the gap
+  row->chars = editorArenaRealloc(row->chars, row->cap, newcap, &newcap);
+  memmove(&row->chars[newcap - tail], &row->chars[row->cap - tail], tail);
+  row->cap = newcap;
+}
+
+// Moves the gap of an owned row so it starts before logical char "at"
+// Only the chars between the old and new gap position are moved
+void editorRowMoveGap(erow *row, int at) {
+  int gaplen = row->cap - row->size;
+  if (at < row->gap)
+    memmove(&row->chars[at + gaplen], &row->chars[at], row->gap - at);
+  else if (at > row->gap)
+    memmove(&row->chars[row->gap], &row->chars[row->gap + gaplen], at - row->gap);
+  row->gap = at;
+}
+
+// Closes the gap (moves it to the end) and returns row->chars as one contiguous run
+// Called before code that reads chars in bulk; a no-op unless the row was just typed into
+char *editorRowChars(erow *row) {
+  if (row->gap != row->size)
+    editorRowMoveGap(row, row->size);
+  if (row->cap > row->size)
+    row->chars[row->size] = '\0';
+  return row->chars;
+}
+
+// Cuts row down to its first len chars
+void editorRowTruncate(erow *row, int len) {
+  if (len >= row->size) return;
+  if (row->flags & ROW_CHARS_VIEW) {
+    row->size = len;
+    row->gap = len;
+  } else {
+    editorRowMoveGap(row, len);
+    row->size = len; // everything after the gap now belongs to it
+  }
+  editorUpdateRowFrom(row, len);
+  E.dirty = 1;
+}
+
+// Deletes n rows starting at 'at'; only the blocks holding them are touched
+void editorDelRows(int at, int n) {
+  if (at < 0 || n <= 0 || at + n > E.numrows) return;
+
+  int off;
+  int b = editorBlockFind(at, &off);
+  int emptied = 0;
+  for (int left = n; left > 0; b++, off = 0) {
+    struct rowBlock *block = E.blocks[b];
+    int cnt = block->numrows - off < left ? block->numrows - off : left;
+    for (int j = off; j < off + cnt; j++) {
+      editorRowSetCommentStale(&block->rows[j], 0);
+      editorFreeRow(&block->rows[j]);
+    }
+    memmove(&block->rows[off], &block->rows[off + cnt], sizeof(erow) * (block->numrows - off - cnt));
+    block->numrows -= cnt;
+    editorBlockCountAdd(b, -cnt);
+    if (block->numrows == 0) emptied = 1;
+    left -= cnt;
+  }
+  if (emptied) editorRowTreeRebuild(); // drops empty blocks
+
+  E.numrows -= n;
+  if (E.find.query) editorFindShiftRows(at, -n);
+  if (at < E.hl_valid_rows) E.hl_valid_rows = at;
+  if (at < E.numrows) editorRowSetCommentStale(editorRow(at), 1); // has a new predecessor
+  E.dirty = 1;
+}
+
+// Closes the document's rows: blocks are freed and all row buffers go back with the arena
+// in one sweep, without visiting the rows
+void editorFreeRows() {
+  for (int b = 0; b < E.numblocks; b++)
+    free(E.blocks[b]);
+  E.numblocks = 0;
+  E.numrows = 0;
+  E.hl_valid_rows = 0;
+  E.hl_pending = 0;
+  E.drawn_screenrows = 0;
+  editorFindReset();
+  editorArenaReset();
+  editorAddBufFree(); // no row views it anymore
+}
+
+// Deletes row 'at' and moves up all the following rows
+void editorDelRow(int at) {
+  editorDelRows(at, 1);
+}
+
+// Inserts character into given row at given position.
+// The char goes into the row's gap: typing at the same spot moves no bytes and (amortized) allocates nothing
+void editorRowInsertChar(erow *row, int at, char c) {
+  if (at < 0 || at > row->size) at = row->size;
+  editorRowMaterialize(row);
+  if (row->cap - row->size < 2)
+    editorRowGrow(row, row->size + 2); // +1 for the null terminator editorRowChars() writes
+  editorRowMoveGap(row, at);
+  row->chars[row->gap++] = c;
+  row->size++;
+  editorUpdateRowFrom(row, at);
+  E.dirty = 1;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorRowMaterialize(row);
+  editorRowGrow(row, row->size + len + 1);
+  editorRowChars(row);
+  memcpy(&row->chars[row->size], s, len);
+  int at = row->size;
+  row->size += len;
+  row->gap = row->size;
+  row->chars[row->size] = '\0';
+  editorUpdateRowFrom(row, at);
+  E.dirty = 1;
+}
+
+// Appends s, which must stay valid and unchanged (add buffer or view store), to row
+// An empty row just becomes a view of s instead of copying it
+void editorRowAppendView(erow *row, char *s, size_t len) {
+  if (row->size != 0) {
+    editorRowAppendString(row, s, len);
+    return;
+  }
+  if (!(row->flags & ROW_CHARS_VIEW))
+    editorArenaFree(row->chars, row->cap);
+  row->chars = s;
+  row->size = len;
+  row->cap = 0;
+  row->gap = len;
+  row->flags |= ROW_CHARS_VIEW;
+  editorUpdateRow(row);
+  E.dirty = 1;
+}
+
+// Deletes character at given space
+// Chars next to the gap are just absorbed into it, so repeated deletes at the cursor move no bytes
+void editorRowDelChar(erow *row, int at) {
+  if (at < 0 || at >= row->size) return;
+  editorRowMaterialize(row);
+  if (at + 1 == row->gap)
+    row->gap--;                 // char right before the gap (backspace)
+  else
+    editorRowMoveGap(row, at);  // char is now right after the gap
+  row->size--;
+  editorUpdateRowFrom(row, at);
+  E.dirty = 1;
+}
+
+// Applies edits (sorted by cx, not overlapping) to row, building its new chars in one buffer
+void editorRowSplice(erow *row, struct rowEdit *edits, int n) {
+  if (n == 0) return;
+  int size = row->size;
+  for (int i = 0; i < n; i++)
+    size += edits[i].textlen - edits[i].len;
+
+  char *src = row->size ? editorRowChars(row) : "";
+  int cap;
+  char *chars = editorArenaAlloc(size + 1, &cap);
+  int from = 0, to = 0;
+  for (int i = 0; i < n; i++) {
+    memcpy(&chars[to], &src[from], edits[i].cx - from);
+    to += edits[i].cx - from;
+    if (edits[i].textlen) memcpy(&chars[to], edits[i].text, edits[i].textlen);
+    to += edits[i].textlen;
+    from = edits[i].cx + edits[i].len;
+  }
+  memcpy(&chars[to], &src[from], row->size - from);
+  chars[size] = '\0';
+
+  if (!(row->flags & ROW_CHARS_VIEW))
+    editorArenaFree(row->chars, row->cap);
+  row->chars = chars;
+  row->cap = cap;
+  row->size = size;
+  row->gap = size;
+  row->flags &= ~ROW_CHARS_VIEW;
+  editorUpdateRowFrom(row, edits[0].cx);
+  E.dirty = 1;
+}
+
+/*** EDITOR OPERATIONS ***/
+
+// Replaces spacing (' ', '\t') of row_dst with that of row_src, returns number of space+tab chars
+int editorMatchSpaces(erow *row_src, erow *row_dst) {
+  editorRowChars(row_src);
+  editorRowChars(row_dst);
+
+  // count spaces and tabs in src
+  int num_space_chars; // #' ' + #'\t'
+  for (num_space_chars=0; num_space_chars < row_src->size && (row_src->chars[num_space_chars]==' ' || row_src->chars[num_space_chars]=='\t'); num_space_chars++);
+  // if (num_space_chars == row_src->size && num_space_chars != 0) num_space_chars--;
+  // count spaces and tabs in dst
+  int num_space_chars_dst; // #' ' + #'\t'
+  for (num_space_chars_dst=0; num_space_chars_dst < row_dst->size && (row_dst->chars[num_space_chars_dst]==' ' || row_dst->chars[num_space_chars_dst]=='\t'); num_space_chars_dst++);
+  // if (num_space_chars_dst == row_dst->size && num_space_chars_dst != 0) num_space_chars_dst--;
+
+  // create new dst such that it contains the spacing of row and the rest of dst
+
+  // This handles the new row being bigger or smaller than the old one
+  int new_row_size = row_dst->size - num_space_chars_dst + num_space_chars;
+  int new_cap;
+  char *new_dst_row = editorArenaAlloc(new_row_size, &new_cap);
+  if (row_dst->size != num_space_chars_dst)
+    memcpy(&new_dst_row[num_space_chars], &row_dst->chars[num_space_chars_dst], row_dst->size-num_space_chars_dst);
+  if (num_space_chars)
+    memcpy(new_dst_row, row_src->chars, num_space_chars);
+  row_dst->size = new_row_size;
+  if (!(row_dst->flags & ROW_CHARS_VIEW))
+    editorArenaFree(row_dst->chars, row_dst->cap);
+  row_dst->chars = new_dst_row;
+  row_dst->cap = new_cap;
+  row_dst->gap = new_row_size;
+  row_dst->flags &= ~ROW_CHARS_VIEW;
+
+  return num_space_chars;
+}
+
+// Inserts character at cursors. If on line past EOF, it creates a new row.
+void editorInsertChar(char c, int record_undo_event) {
+  if (E.cy == E.numrows) {
+    editorInsertRow(E.numrows, "", 0); // append row at end
+  }
+  editorRowInsertChar(editorRow(E.cy), E.cx, c);
+  if (record_undo_event)
+    addUndoEvent(EVENT_INSERT_CHAR, E.cy, E.cx, &c, 1);
+  E.cx++;
+}
+
+void editorInsertNewline(int match_spaces, int record_undo_event) {
+  if (E.cx == 0)
+    editorInsertRow(E.cy, "", 0); // just insert new line
+  else {
+    // insert new line with everything from cx onward on it
+    erow *row = editorRow(E.cy);
+    editorInsertRow(E.cy + 1, &editorRowChars(row)[E.cx], row->size - E.cx);
+    editorRowTruncate(editorRow(E.cy), E.cx);
+  }
+  if (match_spaces) {
+    int spaces = editorMatchSpaces(editorRow(E.cy), editorRow(E.cy+1));
+    editorUpdateRow(editorRow(E.cy+1));
+    E.cx = spaces;
+  } else {
+    E.cx = 0;
+  }
+  E.cy++;
+
+  if (record_undo_event) {
+    // Coordinates are on new line after spaces
+    addUndoEvent(EVENT_INSERT_NEWLINE, E.cy, E.cx, editorRow(E.cy)->chars, E.cx);
+  }
+
+}
+
+// Deletes character left of cursor (backspace)
+void editorDelChar(int record_undo_event) {
+  if (E.cy == E.numrows) return;
+  if (E.cx == 0 && E.cy == 0) return;
+
+  if (record_undo_event) {
+    if (E.cx > 0) {
+      char c = ROW_CHAR(editorRow(E.cy), E.cx-1);
+      addUndoEvent(EVENT_DELETE_CHAR, E.cy, E.cx-1, &c, 1);
+    }
+    else
+      addUndoEvent(EVENT_DELETE_CHAR, E.cy-1, editorRow(E.cy-1)->size, "\n", 1);
+  }
+
+  erow *row = editorRow(E.cy);
+  if (E.cx > 0)
+    editorRowDelChar(row, --E.cx);
+  else {
+    // Delete line and move data to previous line
+    E.cx = editorRow(E.cy - 1)->size;
+    editorRowAppendString(editorRow(E.cy - 1), editorRowChars(row), row->size);
+    editorDelRow(E.cy--);
+  }
+}
+
+// Insert given lines of text at the cursor position
+void editorInsertText(char* text, int textlen, int record_undo_event) {
+  // Text is stored once in the add buffer: whole pasted lines become views into it
+  if (!editorAddBufContains(text))
+    text = editorAddBufAppend(text, textlen);
+
+  if (record_undo_event)
+    addUndoEvent(EVENT_INSERT_STRING, E.cy, E.cx, text, textlen);
+
+  if (E.cy == E.numrows) {
+    editorInsertRow(E.cy, NULL, 0);
+  }
+
+  // Count pasted lines so every new row can be spliced in at once
+  int newlines = 0;
+  for (char *nl = text; (nl = memchr(nl, '\n', textlen - (nl - text))) != NULL; nl++)
+    newlines++;
+
+  // Copy text from E.cx+1 -> (a view row's chars are read-only, so they can be used in place)
+  erow *row = editorRow(E.cy);
+  editorRowChars(row);
+  char* rest_of_line = NULL;
+  int rol_size = row->size - E.cx; // 11-8=3
+  int rol_owned = 0;
+  if (rol_size > 0) {
+    if (row->flags & ROW_CHARS_VIEW) {
+      rest_of_line = &row->chars[E.cx];
+    } else {
+      rest_of_line = malloc(rol_size);
+      memcpy(rest_of_line, &row->chars[E.cx], rol_size);
+      rol_owned = 1;
+    }
+  }
+  editorRowTruncate(row, E.cx);
+
+  editorInsertRows(E.cy + 1, newlines);
+
+  // Get lines and paste them in: look for '\r\n's
+  // First line is appended to the current row, the rest fill the new (empty) rows
+  int line_start = 0;
+  for (int i = 0; i < textlen; i++) {
+    if (text[i] == '\n') {
+      int line_end = i>0&&text[i-1]=='\r'?i-1:i; // ignore '\r'
+      editorRowAppendView(editorRow(E.cy), &text[line_start], line_end-line_start);
+      E.cy++;
+      line_start = i+1;
+    }
+  }
+  // Insert final part + rest_of_line
+  editorRowAppendView(editorRow(E.cy), &text[line_start], textlen-line_start);
+  E.cx = editorRow(E.cy)->size;
+  if (rol_size > 0)
+    editorRowAppendString(editorRow(E.cy), rest_of_line, rol_size);
+
+  if (rol_owned) free(rest_of_line);
+}
+
+/*** FILE MAPPING ***/
+
+// Maps a file read-only into memory and sets len to its size; view rows point into it, so its bytes
+// must not change while it is open:
+// - on Windows the file stays open w/o write (or delete) sharing until editorUnmapFile(), so other
+//   processes can't rewrite or truncate it meanwhile (they get a sharing violation); a file some
+//   process has open for writing already can't be opened like this and is read line by line
+// - elsewhere nothing can keep another process from truncating it, which would make the next read
+//   through a mapping fault (SIGBUS), so the file is read into one buffer instead: a snapshot
+// Returns NULL if the file can't be loaded this way (including empty files), so callers can fall
+// back to reading it line by line
+char *editorMapFile(const char *filename, size_t *len, HANDLE *file) {
+#ifdef _WIN32
+  *file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (*file == INVALID_HANDLE_VALUE) return NULL;
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(*file, &size) || size.QuadPart == 0 || (unsigned long long)size.QuadPart > (size_t)-1) {
+    CloseHandle(*file);
+    return NULL;
+  }
+
+  HANDLE mapping = CreateFileMappingA(*file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mapping == NULL) {
+    CloseHandle(*file);
+    return NULL;
+  }
+
+  char *map = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping); // the view keeps the mapping alive until it is unmapped
+  if (map == NULL) {
+    CloseHandle(*file);
+    return NULL;
+  }
+
+  *len = (size_t)size.QuadPart;
+  return map;
+#else
+  *file = NULL;
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+
+  char *map = malloc(st.st_size);
+  size_t got = 0;
+  while (map && got < (size_t)st.st_size) {
+    ssize_t n = read(fd, map + got, st.st_size - got);
+    if (n <= 0) break; // error, or the file shrank since fstat()
+    got += n;
+  }
+  close(fd);
+  if (map && got < (size_t)st.st_size) {
+    free(map);
+    return NULL;
+  }
+
+  *len = st.st_size;
+  return map;
+#endif
+}
+
+void editorUnmapFile(char *map, size_t len, HANDLE file) {
+  (void)len;
+#ifdef _WIN32
+  UnmapViewOfFile(map);
+  CloseHandle(file); // lets other processes write to the file again
+#else
+  (void)file;
+  free(map);
+#endif
+}
+
+// Frees/unmaps the view store; only valid once no row is a view into it
+void editorReleaseViewBuffer() {
+  if (E.viewbuf == NULL) return;
+  if (E.viewbuf_mapped)
+    editorUnmapFile(E.viewbuf, E.viewbuflen, E.viewfile);
+  else
+    free(E.viewbuf);
+  E.viewbuf = NULL;
+  E.viewbuflen = 0;
+  E.viewbuf_mapped = 0;
+}
+
+// Re-points view rows into buf, which must be the output of editorRowsToString()
+// buf becomes the new view store and the old one (usually the file mapping) is released
+void editorRebaseViewRows(char *buf, size_t buflen) {
+  char *p = buf;
+  for (erow *row = editorRowFirst(); row; row = editorRowNext(row)) {
+    if (row->flags & ROW_CHARS_VIEW)
+      row->chars = p;
+    p += row->size + 1; // +1 for '\n'
+  }
+
+  editorReleaseViewBuffer();
+  E.viewbuf = buf;
+  E.viewbuflen = buflen;
+  E.viewbuf_mapped = 0;
+}
+
+/*** ADD BUFFER ***/
+
+// Appends s to the add buffer and returns its stable copy
+// Text in the add buffer is never modified or moved, so rows can be views into it
+char *editorAddBufAppend(const char *s, size_t len) {
+  struct addChunk *chunk = E.addbuf;
+  if (chunk == NULL || chunk->cap - chunk->len < len) {
+    size_t cap = len > ADDBUF_CHUNK_SIZE ? len : ADDBUF_CHUNK_SIZE;
+    chunk = malloc(sizeof(struct addChunk) + cap);
+    if (chunk == NULL) die("malloc");
+    chunk->next = E.addbuf;
+    chunk->len = 0;
+    chunk->cap = cap;
+    E.addbuf = chunk;
+  }
+  char *dst = &chunk->data[chunk->len];
+  if (len) memcpy(dst, s, len);
+  chunk->len += len;
+  return dst;
+}
+
+// Returns whether p points into the newest add buffer chunk (the only one still appended to)
+// Text in an older chunk is just copied again, so this stays O(1) per call
+int editorAddBufContains(const char *p) {
+  struct addChunk *chunk = E.addbuf;
+  return chunk && p >= chunk->data && p < chunk->data + chunk->len;
+}
+
+// Frees the whole add buffer; only valid once no row points into it
+void editorAddBufFree() {
+  while (E.addbuf) {
+    struct addChunk *next = E.addbuf->next;
+    free(E.addbuf);
+    E.addbuf = next;
+  }
+}
+
+/*** FILE IO ***/
+
+char *editorRowsToString(int *buflen) {
+  int totlen = 0;
+  for (erow *row = editorRowFirst(); row; row = editorRowNext(row))
+    totlen += row->size + 1;
+  *buflen = totlen;
+
+  char *buf = malloc(totlen);
+  char *p = buf;
+  for (erow *row = editorRowFirst(); row; row = editorRowNext(row)) {
+    memcpy(p, editorRowChars(row), row->size);
+    p += row->size;
+    *p = '\n';
+    p++;
+  }
+
+  return buf;
+}
+
+void editorOpen(char *filename) {
+  free(E.filename);
+  E.filename = strdup(filename);
+
+  editorFreeRows(); // drop whatever document was open before
+  E.undoBufSize = 0; // its event was about the old document
+  editorSelectSyntaxHighlight(); // recompute syntax style whenever new file is opened
+
+  // Mapped load: every row is a view into the file until it gets edited
+  size_t maplen;
+  HANDLE mapfile;
+  char *map = editorMapFile(filename, &maplen, &mapfile);
+  if (map) {
+    editorReleaseViewBuffer();
+    E.viewbuf = map;
+    E.viewbuflen = maplen;
+    E.viewbuf_mapped = 1;
+    E.viewfile = mapfile;
+
+    char *end = map + maplen;
+
+    // Count lines first so all rows are spliced in with a single insertion
+    int numlines = 0;
+    for (char *p = map; p < end; numlines++) {
+      char *nl = memchr(p, '\n', end - p);
+      p = nl ? nl + 1 : end;
+    }
+
+    int at = E.numrows;
+    editorInsertRows(at, numlines);
+
+    char *p = map;
+    erow *row = editorRow(at);
+    for (int i = 0; i < numlines; i++, row = editorRowNext(row)) {
+      char *nl = memchr(p, '\n', end - p);
+      char *line_end = nl ? nl : end;
+      size_t linelen = line_end - p;
+      while (linelen > 0 && p[linelen-1] == '\r')
+        linelen--;
+
+      row->chars = p;
+      row->size = linelen;
+      row->gap = linelen;
+      row->flags |= ROW_CHARS_VIEW;
+      p = nl ? nl + 1 : end;
+    }
+    E.dirty = 0;
+    return;
+  }
+
+  // Fall back to reading line-by-line (empty files, pipes, failed mappings)
+  FILE *fp = fopen(filename, "r");
+  if (!fp) die("fopen");
+
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    while (linelen > 0 && (line[linelen-1] == '\n' || line[linelen-1]=='\r'))
+      linelen--;
+    editorInsertRow(E.numrows, line, linelen);
+  }
+  free(line);
+  fclose(fp);
+  E.dirty = 0;
+}
+
+void editorSave() {
+  if (E.filename == NULL) {
+    E.filename = editorPrompt("Save as: %s (ESC to cancel)", 0, 0, NULL);
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntaxHighlight(); // recompute syntax style when new filename is saved
+  }
+
+  int len;
+  char *buf = editorRowsToString(&len);
+
+  // View rows can't keep pointing into the file we are about to overwrite:
+  // move them onto the save buffer (which holds the same bytes) and keep it as the new view store
+  int keep_buf = (E.viewbuf != NULL);
+  if (keep_buf)
+    editorRebaseViewRows(buf, len);
+
+  int fd = open(E.filename, O_RDWR | O_CREAT, 0644); // Open file - read/write, create if doesn't exist, w/ file permissions 0644
+  if (fd != -1) { // valid file open
+    // Change file size to len (we do this before write instead of w/ open flag to save a bit from failed write)
+    if (ftruncate(fd, len) != -1) {
+      if (write(fd, buf, len) == len) {
+        close(fd);
+        if (!keep_buf) free(buf);
+        E.dirty = 0;
+        editorSetStatusMessage("%d bytes written to disk", len);
+        return;
+      }
+    }
+    close(fd);
+  }
+  if (!keep_buf) free(buf);
+  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+}
+
+/*** REGEX ***/
+
+// Regexes for find: literals, '.', [classes] (ranges, ^ to negate), \d \w \s (capitals negate),
+// * + ?, |, ( ) and the ^ $ anchors; matches are leftmost-longest
+// The pattern is compiled to a Thompson NFA program run as a lazy DFA: every byte of a row is
+// looked at once per direction, whatever the pattern (no backtracking)
+
+struct reNode *editorRegexNode(int type, struct reNode *left, struct reNode *right) {
+  struct reNode *n = calloc(1, sizeof(struct reNode));
+  if (n == NULL) die("calloc");
+  n->type = type;
+  n->left = left;
+  n->right = right;
+  return n;
+}
+
+void editorRegexFreeNode(struct reNode *n) {
+  if (n == NULL) return;
+  editorRegexFreeNode(n->left);
+  editorRegexFreeNode(n->right);
+  free(n);
+}
+
+// Adds the byte(s) of the escape at *p (just past the backslash) to cls and moves past it
+// Returns 0 if the pattern ends there
+int editorRegexEscape(const char **p, unsigned char *cls) {
+  char c = **p;
+  if (c == '\0') return 0;
+  (*p)++;
+
+  unsigned char named[32] = {0};
+  switch (tolower(c)) {
+    case 'd':
+      for (int b = '0'; b <= '9'; b++) RE_SET(named, b);
+      break;
+    case 'w':
+      for (int b = 0; b < 256; b++) if (isalnum(b) || b == '_') RE_SET(named, b);
+      break;
+    case 's':
+      for (int b = 0; b < 256; b++) if (isspace(b)) RE_SET(named, b);
+      break;
+    default:
+      RE_SET(cls, (c == 't') ? '\t' : c);
+      return 1;
+  }
+  for (int i = 0; i < 32; i++)
+    cls[i] |= isupper(c) ? ~named[i] : named[i];
+  return 1;
+}
+
+struct reNode *editorRegexAtom(const char **p, const char **error) {
+  struct reNode *n;
+  unsigned char c = *(*p)++;
+  switch (c) {
+    case '(':
+      n = editorRegexAlt(p, error);
+      if (n == NULL) return NULL;
+      if (**p != ')') {
+        *error = "missing )";
+        editorRegexFreeNode(n);
+        return NULL;
+      }
+      (*p)++;
+      return n;
+
+    case '^':
+      return editorRegexNode(RE_N_BOL, NULL, NULL);
+
+    case '$':
+      return editorRegexNode(RE_N_EOL, NULL, NULL);
+
+    case '*':
+    case '+':
+    case '?':
+      *error = "nothing to repeat";
+      return NULL;
+  }
+
+  n = editorRegexNode(RE_N_CLASS, NULL, NULL);
+  if (c == '.') {
+    memset(n->cls, 0xff, sizeof(n->cls));
+  } else if (c == '\\') {
+    if (!editorRegexEscape(p, n->cls)) *error = "trailing \\";
+  } else if (c == '[') {
+    int negate = (**p == '^');
+    if (negate) (*p)++;
+    // A ']' right after the opening bracket is literal
+    for (int first = 1; first || **p != ']'; first = 0) {
+      unsigned char lo = **p;
+      if (lo == '\0') {
+        *error = "missing ]";
+        break;
+      }
+      (*p)++;
+      if (lo == '\\') {
+        if (!editorRegexEscape(p, n->cls)) *error = "missing ]";
+      } else if ((*p)[0] == '-' && (*p)[1] != ']' && (*p)[1] != '\0') {
+        unsigned char hi = (*p)[1];
+        *p += 2;
+        if (hi < lo) *error = "bad range";
+        for (int b = lo; b <= hi; b++) RE_SET(n->cls, b);
+      } else
+        RE_SET(n->cls, lo);
+      if (*error) break;
+    }
+    if (!*error) (*p)++;
+    if (negate)
+      for (int i = 0; i < 32; i++) n->cls[i] = ~n->cls[i];
+  } else
+    RE_SET(n->cls, c);
+
+  if (*error) {
+    editorRegexFreeNode(n);
+    return NULL;
+  }
+  return n;
+}
+
+struct reNode *editorRegexRepeat(const char **p, const char **error) {
+  struct reNode *n = editorRegexAtom(p, error);
+  while (n && (**p == '*' || **p == '+' || **p == '?')) {
+    int type = (**p == '*') ? RE_N_STAR : (**p == '+') ? RE_N_PLUS : RE_N_QUEST;
+    (*p)++;
+    n = editorRegexNode(type, n, NULL);
+  }
+  return n;
+}
+
+struct reNode *editorRegexCat(const char **p, const char **error) {
+  struct reNode *n = editorRegexNode(RE_N_EMPTY, NULL, NULL);
+  while (**p != '\0' && **p != '|' && **p != ')') {
+    struct reNode *right = editorRegexRepeat(p, error);
+    if (right == NULL) {
+      editorRegexFreeNode(n);
+      return NULL;
+    }
+    n = editorRegexNode(RE_N_CAT, n, right);
+  }
+  return n;
+}
+
+struct reNode *editorRegexAlt(const char **p, const char **error) {
+  struct reNode *n = editorRegexCat(p, error);
+  while (n && **p == '|') {
+    (*p)++;
+    struct reNode *right = editorRegexCat(p, error);
+    if (right == NULL) {
+      editorRegexFreeNode(n);
+      return NULL;
+    }
+    n = editorRegexNode(RE_N_ALT, n, right);
+  }
+  return n;
+}
+
+// Returns the number of instructions n compiles to
+int editorRegexSize(struct reNode *n) {
+  switch (n->type) {
+    case RE_N_CLASS: case RE_N_BOL: case RE_N_EOL: return 1;
+    case RE_N_CAT: return editorRegexSize(n->left) + editorRegexSize(n->right);
+    case RE_N_ALT: return editorRegexSize(n->left) + editorRegexSize(n->right) + 2;
+    case RE_N_STAR: return editorRegexSize(n->left) + 2;
+    case RE_N_PLUS: case RE_N_QUEST: return editorRegexSize(n->left) + 1;
+  }
+  return 0;
+}
+
+// Writes the instructions of n at prog[*pc]; reverse emits the program of the reversed
+// pattern (concatenations swapped, ^ and $ exchanged)
+void editorRegexEmit(struct reNode *n, struct reInst *prog, int *pc, int reverse) {
+  int split, jmp, loop;
+  switch (n->type) {
+    case RE_N_CLASS:
+      prog[*pc].op = RE_CLASS;
+      memcpy(prog[*pc].cls, n->cls, sizeof(n->cls));
+      prog[*pc].x = *pc + 1;
+      (*pc)++;
+      break;
+
+    case RE_N_BOL:
+    case RE_N_EOL:
+      prog[*pc].op = ((n->type == RE_N_BOL) != reverse) ? RE_BOL : RE_EOL;
+      prog[*pc].x = *pc + 1;
+      (*pc)++;
+      break;
+
+    case RE_N_CAT:
+      editorRegexEmit(reverse ? n->right : n->left, prog, pc, reverse);
+      editorRegexEmit(reverse ? n->left : n->right, prog, pc, reverse);
+      break;
+
+    case RE_N_ALT:
+      split = (*pc)++;
+      prog[split].op = RE_SPLIT;
+      prog[split].x = *pc;
+      editorRegexEmit(n->left, prog, pc, reverse);
+      jmp = (*pc)++;
+      prog[jmp].op = RE_JMP;
+      prog[split].y = *pc;
+      editorRegexEmit(n->right, prog, pc, reverse);
+      prog[jmp].x = *pc;
+      break;
+
+    case RE_N_STAR:
+      split = (*pc)++;
+      prog[split].op = RE_SPLIT;
+      prog[split].x = *pc;
+      editorRegexEmit(n->left, prog, pc, reverse);
+      prog[*pc].op = RE_JMP;
+      prog[*pc].x = split;
+      (*pc)++;
+      prog[split].y = *pc;
+      break;
+
+    case RE_N_PLUS:
+      loop = *pc;
+      editorRegexEmit(n->left, prog, pc, reverse);
+      prog[*pc].op = RE_SPLIT;
+      prog[*pc].x = loop;
+      prog[*pc].y = *pc + 1;
+      (*pc)++;
+      break;
+
+    case RE_N_QUEST:
+      split = (*pc)++;
+      prog[split].op = RE_SPLIT;
+      prog[split].x = *pc;
+      editorRegexEmit(n->left, prog, pc, reverse);
+      prog[split].y = *pc;
+      break;
+  }
+}
+
+void editorRegexDfaInit(struct reDfa *dfa, struct reNode *root, int reverse, int unanchored) {
+  int size = editorRegexSize(root) + 1;
+  dfa->prog = calloc(size, sizeof(struct reInst));
+  dfa->states = malloc(sizeof(struct reDfaState *) * RE_MAX_DFA_STATES);
+  dfa->slots = malloc(sizeof(int) * RE_MAX_DFA_STATES * 2);
+  dfa->mark = calloc(size, sizeof(int));
+  dfa->stack = malloc(sizeof(int) * size);
+  dfa->set = malloc(sizeof(int) * size);
+  dfa->reach = malloc(sizeof(int) * size * 2);
+  if (!dfa->prog || !dfa->states || !dfa->slots || !dfa->mark || !dfa->stack || !dfa->set || !dfa->reach)
+    die("malloc");
+
+  int pc = 0;
+  editorRegexEmit(root, dfa->prog, &pc, reverse);
+  dfa->prog[pc].op = RE_MATCH;
+  dfa->ninst = pc + 1;
+  dfa->unanchored = unanchored;
+  dfa->start[0] = dfa->start[1] = -1;
+  dfa->nstates = 0;
+  for (int i = 0; i < RE_MAX_DFA_STATES * 2; i++) dfa->slots[i] = -1;
+  dfa->gen = 0;
+  dfa->flushes = 0;
+}
+
+void editorRegexDfaFree(struct reDfa *dfa) {
+  for (int i = 0; i < dfa->nstates; i++) {
+    free(dfa->states[i]->set);
+    free(dfa->states[i]);
+  }
+  free(dfa->states);
+  free(dfa->slots);
+  free(dfa->mark);
+  free(dfa->stack);
+  free(dfa->set);
+  free(dfa->reach);
+  free(dfa->prog);
+}
+
+// Adds instruction pc, and all it reaches w/o consuming a byte, to the set being built (dfa->set[0..*n))
+// Only instructions that wait for a byte, the end of the row or that match are kept
+void editorRegexAdd(struct reDfa *dfa, int pc, int bol, int *n) {
+  if (dfa->mark[pc] == dfa->gen) return;
+  dfa->mark[pc] = dfa->gen;
+  int top = 0;
+  dfa->stack[top++] = pc;
+  while (top) {
+    int at = dfa->stack[--top];
+    struct reInst *in = &dfa->prog[at];
+    int to[2];
+    int nto = 0;
+    if (in->op == RE_SPLIT) {
+      to[nto++] = in->y;
+      to[nto++] = in->x;
+    } else if (in->op == RE_JMP || (in->op == RE_BOL && bol)) {
+      to[nto++] = in->x;
+    } else if (in->op != RE_BOL) {
+      dfa->set[(*n)++] = at;
+    }
+    for (int k = 0; k < nto; k++) {
+      if (dfa->mark[to[k]] == dfa->gen) continue;
+      dfa->mark[to[k]] = dfa->gen;
+      dfa->stack[top++] = to[k];
+    }
+  }
+}
+
+// Returns the state for the set in dfa->set[0..n), making it if needed
+// A full cache is dropped and refilled from this set on (dfa->flushes tells callers)
+int editorRegexIntern(struct reDfa *dfa, int n) {
+  int *set = dfa->set;
+  for (int i = 1; i < n; i++)
+    for (int j = i; j > 0 && set[j - 1] > set[j]; j--) {
+      int t = set[j];
+      set[j] = set[j - 1];
+      set[j - 1] = t;
+    }
+
+  unsigned int hash = 2166136261u; // FNV-1a
+  for (int i = 0; i < n; i++) hash = (hash ^ set[i]) * 16777619u;
+  int nslots = RE_MAX_DFA_STATES * 2;
+  int slot = hash % nslots;
+  for (; dfa->slots[slot] != -1; slot = (slot + 1) % nslots) {
+    struct reDfaState *st = dfa->states[dfa->slots[slot]];
+    if (st->nset == n && !memcmp(st->set, set, sizeof(int) * n)) return dfa->slots[slot];
+  }
+
+  if (dfa->nstates == RE_MAX_DFA_STATES) {
+    for (int i = 0; i < dfa->nstates; i++) {
+      free(dfa->states[i]->set);
+      free(dfa->states[i]);
+    }
+    dfa->nstates = 0;
+    for (int i = 0; i < nslots; i++) dfa->slots[i] = -1;
+    dfa->start[0] = dfa->start[1] = -1;
+    dfa->flushes++;
+    slot = hash % nslots;
+  }
+
+  struct reDfaState *st = malloc(sizeof(struct reDfaState));
+  if (st == NULL) die("malloc");
+  st->set = malloc(sizeof(int) * (n ? n : 1));
+  if (st->set == NULL) die("malloc");
+  memcpy(st->set, set, sizeof(int) * n);
+  st->nset = n;
+  memset(st->next, 0xff, sizeof(st->next));
+  st->accept = 0;
+  for (int i = 0; i < n; i++)
+    if (dfa->prog[set[i]].op == RE_MATCH) st->accept = 1;
+
+  // At the end of the row, the RE_EOL instructions of the set go on
+  st->accept_end = st->accept;
+  if (!st->accept) {
+    dfa->gen++;
+    int top = 0;
+    for (int i = 0; i < n; i++)
+      if (dfa->prog[set[i]].op == RE_EOL) {
+        dfa->mark[set[i]] = dfa->gen;
+        dfa->stack[top++] = set[i];
+      }
+    while (top && !st->accept_end) {
+      struct reInst *in = &dfa->prog[dfa->stack[--top]];
+      int to[2];
+      int nto = 0;
+      if (in->op == RE_MATCH) st->accept_end = 1;
+      else if (in->op == RE_SPLIT) {
+        to[nto++] = in->x;
+        to[nto++] = in->y;
+      } else if (in->op == RE_JMP || in->op == RE_EOL)
+        to[nto++] = in->x;
+      for (int k = 0; k < nto; k++) {
+        if (dfa->mark[to[k]] == dfa->gen) continue;
+        dfa->mark[to[k]] = dfa->gen;
+        dfa->stack[top++] = to[k];
+      }
+    }
+  }
+
+  dfa->slots[slot] = dfa->nstates;
+  dfa->states[dfa->nstates] = st;
+  return dfa->nstates++;
+}
+
+// Returns the state the program starts in, at the start of the row (bol) or elsewhere
+int editorRegexStart(struct reDfa *dfa, int bol) {
+  if (dfa->start[bol] == -1) {
+    int n = 0;
+    dfa->gen++;
+    editorRegexAdd(dfa, 0, bol, &n);
+    int st = editorRegexIntern(dfa, n);
+    dfa->start[bol] = st;
+  }
+  return dfa->start[bol];
+}
+
+// Returns the state after byte c from state st
+int editorRegexStep(struct reDfa *dfa, int st, unsigned char c) {
+  struct reDfaState *from = dfa->states[st];
+  if (from->next[c] != -1) return from->next[c];
+
+  int n = 0;
+  dfa->gen++;
+  for (int i = 0; i < from->nset; i++) {
+    struct reInst *in = &dfa->prog[from->set[i]];
+    if (in->op == RE_CLASS && RE_HAS(in->cls, c))
+      editorRegexAdd(dfa, in->x, 0, &n);
+  }
+  if (dfa->unanchored) editorRegexAdd(dfa, 0, 0, &n);
+
+  int flushes = dfa->flushes;
+  int next = editorRegexIntern(dfa, n);
+  if (dfa->flushes == flushes) from->next[c] = next; // else from is gone
+  return next;
+}
+
+// Compiles pattern; returns NULL and sets error if it doesn't parse
+struct regex *editorRegexCompile(const char *pattern, const char **error) {
+  const char *p = pattern;
+  *error = NULL;
+  struct reNode *root = editorRegexAlt(&p, error);
+  if (root && *p != '\0') {
+    *error = "unmatched )";
+    editorRegexFreeNode(root);
+    root = NULL;
+  }
+  if (root == NULL) return NULL;
+
+  struct regex *re = malloc(sizeof(struct regex));
+  if (re == NULL) die("malloc");
+  editorRegexDfaInit(&re->fwd, root, 0, 0);
+  editorRegexDfaInit(&re->rev, root, 1, 1);
+  editorRegexFreeNode(root);
+  return re;
+}
+
+void editorRegexFree(struct regex *re) {
+  if (re == NULL) return;
+  editorRegexDfaFree(&re->fwd);
+  editorRegexDfaFree(&re->rev);
+  free(re);
+}
+
+// Sets starts[i] (0 <= i <= len) to whether a match of re begins at s[i]
+// One backward pass w/ the reversed program, restarted at every byte
+void editorRegexStarts(struct regex *re, const char *s, int len, unsigned char *starts) {
+  struct reDfa *dfa = &re->rev;
+  int st = editorRegexStart(dfa, 1); // the reversed program starts at the end of the row
+  struct reDfaState *at = dfa->states[st];
+  for (int i = len; i > 0; i--) {
+    starts[i] = at->accept;
+    unsigned char c = s[i - 1];
+    st = (at->next[c] != -1) ? at->next[c] : editorRegexStep(dfa, st, c);
+    at = dfa->states[st];
+  }
+  starts[0] = at->accept_end;
+}
+
+// Returns the end of the longest match of re that begins at s[from], or -1
+// Each byte scanned is taken off *budget; returns -2 once it runs out
+int editorRegexLongest(struct regex *re, const char *s, int len, int from, int *budget) {
+  struct reDfa *dfa = &re->fwd;
+  int st = editorRegexStart(dfa, from == 0);
+  int end = -1;
+  for (int i = from; ; i++) {
+    struct reDfaState *at = dfa->states[st];
+    if ((i == len) ? at->accept_end : at->accept) end = i;
+    if (i == len || at->nset == 0) break;
+    if (--*budget < 0) return -2;
+    st = editorRegexStep(dfa, st, s[i]);
+  }
+  return end;
+}
+
+// Sets ends[i] (from <= i <= len) to the end of the longest match of re that begins at s[i], or -1
+// One backward pass over the forward program that keeps, for every instruction, the furthest end a
+// match can reach from it: O(len * program size) whatever the pattern, where scanning forward from
+// each start can go to the end of the row every time
+void editorRegexEnds(struct regex *re, const char *s, int len, int from, int *ends) {
+  struct reDfa *dfa = &re->fwd;
+  int *cur = dfa->reach;
+  int *next = dfa->reach + dfa->ninst; // cur at position j + 1
+  for (int j = len; j >= from; j--) {
+    for (int pc = 0; pc < dfa->ninst; pc++) cur[pc] = -1;
+    // Jumps mostly go forward, so this settles in a pass or two; loops (* and +) jump back
+    int changed = 1;
+    while (changed) {
+      changed = 0;
+      for (int pc = dfa->ninst - 1; pc >= 0; pc--) {
+        struct reInst *in = &dfa->prog[pc];
+        int v = -1;
+        switch (in->op) {
+          case RE_CLASS: if (j < len && RE_HAS(in->cls, s[j])) v = next[in->x]; break;
+          case RE_SPLIT: v = (cur[in->x] > cur[in->y]) ? cur[in->x] : cur[in->y]; break;
+          case RE_JMP: v = cur[in->x]; break;
+          case RE_BOL: if (j == 0) v = cur[in->x]; break;
+          case RE_EOL: if (j == len) v = cur[in->x]; break;
+          case RE_MATCH: v = j; break;
+        }
+        if (v > cur[pc]) {
+          cur[pc] = v;
+          changed = 1;
+        }
+      }
+    }
+    ends[j] = cur[0];
+    int *t = cur;
+    cur = next;
+    next = t;
+  }
+}
+
+/*** FIND ***/
+
+// Returns the first occurrence of needle in the len bytes at hay (which need not be null-terminated)
+char *editorMemSearch(char *hay, int len, char *needle, int nlen) {
+  if (nlen == 0) return hay;
+  char *end = hay + len - nlen + 1; // last possible start + 1
+  for (char *p = hay; p < end; p++) {
+    p = memchr(p, needle[0], end - p);
+    if (p == NULL) return NULL;
+    if (!memcmp(p, needle, nlen)) return p;
+  }
+  return NULL;
+}
+
+// Horspool variant of editorMemSearch(); skip holds the shift for each byte (see editorFindSetQuery())
+char *editorBmhSearch(char *hay, int len, char *needle, int nlen, const int *skip) {
+  char last = needle[nlen - 1];
+  for (int i = nlen - 1; i < len; i += skip[(unsigned char)hay[i]])
+    if (hay[i] == last && !memcmp(&hay[i - nlen + 1], needle, nlen - 1))
+      return &hay[i - nlen + 1];
+  return NULL;
+}
+
+// Returns the first occurrence of f's query in the len bytes at hay
+char *editorFindNext(struct findState *f, char *hay, int len) {
+  if (f->qlen >= FIND_BMH_MIN) return editorBmhSearch(hay, len, f->query, f->qlen, f->skip);
+  return editorMemSearch(hay, len, f->query, f->qlen);
+}
+
+// Appends a match to f->matches
+void editorFindAdd(struct findState *f, int row, int cx, int len) {
+  if (f->nmatches == f->cap) {
+    f->cap = f->cap ? f->cap * 2 : 64;
+    f->matches = realloc(f->matches, sizeof(struct findMatch) * f->cap);
+    if (f->matches == NULL) die("realloc");
+  }
+  f->matches[f->nmatches].row = row;
+  f->matches[f->nmatches].cx = cx;
+  f->matches[f->nmatches].len = len;
+  f->nmatches++;
+}
+
+// Appends the matches in the size chars of row "at" to f->matches
+void editorFindText(struct findState *f, char *chars, int size, int at) {
+  if (f->use_regex) {
+    if (f->re == NULL) return;
+    if (size + 1 > f->startscap) {
+      f->startscap = (size + 1) * 2;
+      f->starts = realloc(f->starts, f->startscap);
+      f->ends = realloc(f->ends, sizeof(int) * f->startscap);
+      if (f->starts == NULL || f->ends == NULL) die("realloc");
+    }
+    editorRegexStarts(f->re, chars, size, f->starts);
+    // Longest ends are scanned forward from each start until that has cost FIND_REGEX_SCAN bytes per
+    // char of the row; the rest of the row then gets them all from one editorRegexEnds() pass
+    int budget = FIND_REGEX_SCAN * size + 64;
+    int have_ends = 0;
+    for (int cx = 0; cx < size; cx++) {
+      if (!f->starts[cx]) continue;
+      int end = have_ends ? f->ends[cx] : editorRegexLongest(f->re, chars, size, cx, &budget);
+      if (end == -2) {
+        editorRegexEnds(f->re, chars, size, cx, f->ends);
+        have_ends = 1;
+        end = f->ends[cx];
+      }
+      if (end <= cx) continue; // empty matches aren't shown
+      editorFindAdd(f, at, cx, end - cx);
+      cx = end - 1;
+    }
+    return;
   }
-}
 
-// Insert given lines of text at the cursor position
-void editorInsertText(char* text, int textlen, int record_undo_event) {
-  if (record_undo_event)
-    addUndoEvent(EVENT_INSERT_STRING, E.cy, E.cx, text, textlen);
+  if (f->qlen == 0) return; // an empty query matches nothing
+  for (char *p = chars; (p = editorFindNext(f, p, size - (p - chars))) != NULL; p++)
+    editorFindAdd(f, at, p - chars, f->qlen);
+}
 
-  if (E.cy == E.numrows) {
-    editorInsertRow(E.cy, NULL, 0);
+// Returns a buffer of f that holds at least size bytes (valid until the next call)
+char *editorFindScratch(struct findState *f, int size) {
+  if (size > f->scratchcap) {
+    f->scratchcap = size * 2;
+    f->scratch = realloc(f->scratch, f->scratchcap);
+    if (f->scratch == NULL) die("realloc");
   }
+  return f->scratch;
+}
 
-  // Copy text from E.cx+1 ->
-  char* rest_of_line = NULL;
-  int rol_size = E.row[E.cy].size - E.cx; // 11-8=3
-  if (rol_size > 0) {
-    rest_of_line = malloc(rol_size);
-    memcpy(rest_of_line, &E.row[E.cy].chars[E.cx], rol_size);
+// Appends the matches in row (line number at) to f->matches
+// Rows are searched in chars rather than render so tabs don't shift the results
+// The row's gap is left where it is, so searching the row being typed into doesn't undo the gap:
+// a literal query is searched in the runs before and after the gap plus the few chars around it,
+// a regex in a copy of the row
+void editorFindRow(struct findState *f, erow *row, int at) {
+  if (row->gap == row->size) {
+    editorFindText(f, row->size ? row->chars : "", row->size, at);
+    return;
   }
-  E.row[E.cy].size = E.cx;
+  int tail = row->size - row->gap;
+  char *after = &row->chars[row->cap - tail];
+  if (f->use_regex) {
+    char *text = editorFindScratch(f, row->size);
+    memcpy(text, row->chars, row->gap);
+    memcpy(&text[row->gap], after, tail);
+    editorFindText(f, text, row->size, at);
+    return;
+  }
+  if (f->qlen == 0) return;
+
+  editorFindText(f, row->chars, row->gap, at);
+
+  // Matches that straddle the gap start in the last qlen - 1 chars before it
+  int from = row->gap - f->qlen + 1;
+  if (from < 0) from = 0;
+  int to = row->gap + f->qlen - 1;
+  if (to > row->size) to = row->size;
+  char *bridge = editorFindScratch(f, to - from);
+  for (int i = from; i < to; i++) bridge[i - from] = ROW_CHAR(row, i);
+  int n = f->nmatches;
+  editorFindText(f, bridge, to - from, at);
+  int kept = n;
+  for (int j = n; j < f->nmatches; j++) {
+    f->matches[j].cx += from;
+    if (f->matches[j].cx < row->gap) f->matches[kept++] = f->matches[j];
+  }
+  f->nmatches = kept;
 
-  // Get lines and paste them in: look for '\r\n's
-  int line_start = 0;
-  for (int i = 0; i < textlen; i++) {
-    if (text[i] == '\n') {
-      int line_end = i>0&&text[i-1]=='\r'?i-1:i; // ignore '\r'
-      // append at end of current line
-      if (line_start == 0)
-        editorRowAppendString(&E.row[E.cy], text, line_end);
-      else
-        editorInsertRow(++E.cy, &text[line_start], line_end-line_start);
-      line_start = i+1;
+  n = f->nmatches;
+  editorFindText(f, after, tail, at);
+  for (int j = n; j < f->nmatches; j++)
+    f->matches[j].cx += row->gap;
+}
+
+DWORD WINAPI editorFindWorker(LPVOID arg) {
+  struct findWorker *w = arg;
+  struct findPool *pool = &E.find_pool;
+  while (1) {
+    WaitForSingleObject(w->work_event, INFINITE);
+    long c;
+    while (!InterlockedCompareExchange(&pool->cancel, 0, 0) &&
+           (c = InterlockedIncrement(&pool->next_chunk) - 1) < pool->nchunks) {
+      struct findChunk *ch = &pool->chunks[c];
+      int at = ch->first_row;
+      for (int b = ch->first_block; b < ch->first_block + ch->nblocks; b++) {
+        struct rowBlock *block = E.blocks[b];
+        for (int j = 0; j < block->numrows; j++, at++) {
+          erow *row = &block->rows[j];
+          if (row->gap == row->size) {
+            editorFindText(&w->state, row->size ? row->chars : "", row->size, at);
+            continue;
+          }
+          if (ch->ngaps == ch->gapcap) {
+            ch->gapcap = ch->gapcap ? ch->gapcap * 2 : 16;
+            ch->gaps = realloc(ch->gaps, sizeof(int) * ch->gapcap);
+            if (ch->gaps == NULL) die("realloc");
+          }
+          ch->gaps[ch->ngaps++] = at;
+        }
+        if (InterlockedCompareExchange(&pool->cancel, 0, 0)) break;
+      }
+      // Hand the matches over to the chunk
+      ch->nmatches = w->state.nmatches;
+      if (ch->nmatches) {
+        ch->matches = malloc(sizeof(struct findMatch) * ch->nmatches);
+        if (ch->matches == NULL) die("malloc");
+        memcpy(ch->matches, w->state.matches, sizeof(struct findMatch) * ch->nmatches);
+      }
+      w->state.nmatches = 0;
+      InterlockedExchange(&ch->done, 1);
+      SetEvent(pool->done_event);
     }
+    if (InterlockedDecrement(&pool->pending) == 0) SetEvent(pool->done_event);
   }
-  // Insert final part + rest_of_line
-  if (line_start == 0)
-    editorRowAppendString(&E.row[E.cy], text, textlen);
-  else
-    editorInsertRow(++E.cy, &text[line_start], textlen-line_start);
-  E.cx = E.row[E.cy].size;
-  if (rol_size > 0)
-    editorRowAppendString(&E.row[E.cy], rest_of_line, rol_size);
+  return 0;
+}
 
-  free(rest_of_line);
+void editorFindPoolStart() {
+  struct findPool *pool = &E.find_pool;
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  pool->nworkers = info.dwNumberOfProcessors;
+  if (pool->nworkers < 1) pool->nworkers = 1;
+  if (pool->nworkers > FIND_MAX_WORKERS) pool->nworkers = FIND_MAX_WORKERS;
+
+  pool->done_event = CreateEvent(NULL, FALSE, FALSE, NULL); // auto-reset
+  if (pool->done_event == NULL) die("CreateEvent");
+  for (int i = 0; i < pool->nworkers; i++) {
+    struct findWorker *w = &pool->workers[i];
+    memset(&w->state, 0, sizeof(w->state));
+    w->work_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (w->work_event == NULL) die("CreateEvent");
+    w->thread = CreateThread(NULL, 0, editorFindWorker, w, 0, NULL);
+    if (w->thread == NULL) die("CreateThread");
+  }
 }
 
-/*** FILE IO ***/
+int editorFindChunkDone(struct findChunk *ch) {
+  return InterlockedCompareExchange(&ch->done, 0, 0) != 0;
+}
 
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  for (int i = 0; i < E.numrows; i++)
-    totlen += E.row[i].size + 1;
-  *buflen = totlen;
+// Sends the cursor to the first match once the chunks before it are done, and draws it if the
+// chunks holding the screen below it are done too; returns whether it did
+int editorFindReportFirst() {
+  struct findPool *pool = &E.find_pool;
+  int c = 0;
+  while (c < pool->nchunks && editorFindChunkDone(&pool->chunks[c]) &&
+         pool->chunks[c].nmatches == 0 && pool->chunks[c].ngaps == 0)
+    c++;
+  if (c == pool->nchunks || !editorFindChunkDone(&pool->chunks[c]) || pool->chunks[c].ngaps) return 0;
+
+  struct findMatch *m = &pool->chunks[c].matches[0];
+  for (int k = c; k < pool->nchunks && pool->chunks[k].first_row <= m->row + E.screenrows; k++)
+    if (!editorFindChunkDone(&pool->chunks[k])) return 0;
+
+  editorScrollTo(m->row, m->cx);
+  editorRefreshScreen();
+  return 1;
+}
 
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (int i = 0; i < E.numrows; i++) {
-    memcpy(p, E.row[i].chars, E.row[i].size);
-    p += E.row[i].size;
-    *p = '\n';
-    p++;
+// Searches the whole buffer w/ the find pool (E.find is set up, w/o matches)
+// Gives up when a key is pressed meanwhile; returns whether the search completed
+int editorFindParallel() {
+  struct findPool *pool = &E.find_pool;
+  struct findState *f = &E.find;
+  if (pool->nworkers == 0) editorFindPoolStart();
+
+  // Chunks of whole blocks
+  pool->nchunks = 0;
+  for (int b = 0, row = 0; b < E.numblocks; ) {
+    if (pool->nchunks == pool->chunkcap) {
+      pool->chunkcap = pool->chunkcap ? pool->chunkcap * 2 : 64;
+      pool->chunks = realloc(pool->chunks, sizeof(struct findChunk) * pool->chunkcap);
+      if (pool->chunks == NULL) die("realloc");
+    }
+    struct findChunk *ch = &pool->chunks[pool->nchunks++];
+    memset(ch, 0, sizeof(*ch));
+    ch->first_block = b;
+    ch->first_row = row;
+    int rows = 0;
+    while (b < E.numblocks && rows < FIND_CHUNK_ROWS) {
+      rows += E.blocks[b++]->numrows;
+      ch->nblocks++;
+    }
+    row += rows;
   }
 
-  return buf;
+  // Each worker gets its own copy of the query (a regex caches states as it runs)
+  for (int i = 0; i < pool->nworkers; i++) {
+    struct findState *ws = &pool->workers[i].state;
+    editorRegexFree(ws->re);
+    ws->re = NULL;
+    ws->query = f->query;
+    ws->qlen = f->qlen;
+    ws->use_regex = f->use_regex;
+    memcpy(ws->skip, f->skip, sizeof(f->skip));
+    if (f->use_regex) ws->re = editorRegexCompile(f->query, &ws->error);
+    ws->nmatches = 0;
+  }
+  pool->next_chunk = 0;
+  pool->cancel = 0;
+  pool->pending = pool->nworkers;
+  for (int i = 0; i < pool->nworkers; i++)
+    SetEvent(pool->workers[i].work_event);
+
+  f->searching = 1;
+  int reported = 0;
+  int complete = 1;
+  while (InterlockedCompareExchange(&pool->pending, 0, 0) > 0) {
+    if (complete && editorKeyPending()) {
+      complete = 0;
+      InterlockedExchange(&pool->cancel, 1);
+    }
+    if (complete && !reported) reported = editorFindReportFirst();
+    WaitForSingleObject(pool->done_event, 10);
+  }
+  f->searching = 0;
+
+  // Merge in row order; rows w/ an open gap are searched here, between the chunk's matches
+  for (int c = 0; c < pool->nchunks; c++) {
+    struct findChunk *ch = &pool->chunks[c];
+    int g = 0;
+    for (int i = 0; complete && i <= ch->nmatches; i++) {
+      for (; g < ch->ngaps && (i == ch->nmatches || ch->gaps[g] < ch->matches[i].row); g++)
+        editorFindRow(f, editorRow(ch->gaps[g]), ch->gaps[g]);
+      if (i < ch->nmatches) editorFindAdd(f, ch->matches[i].row, ch->matches[i].cx, ch->matches[i].len);
+    }
+    free(ch->matches);
+    free(ch->gaps);
+  }
+  pool->nchunks = 0;
+  return complete;
 }
 
-void editorOpen(char *filename) {
-  free(E.filename);
-  E.filename = strdup(filename);
+// Returns the index of the first match on or after row "row"
+int editorFindRowMatches(int row) {
+  int lo = 0, hi = E.find.nmatches;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (E.find.matches[mid].row < row) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
 
-  editorSelectSyntaxHighlight(); // recompute syntax style whenever new file is opened
+// Searches an edited row again and replaces its matches
+void editorFindUpdateRow(erow *row) {
+  struct findState *f = &E.find;
+  int at = editorRowIndex(row);
+  int lo = editorFindRowMatches(at);
+  int hi = editorFindRowMatches(at + 1);
+
+  // Collect the row's matches after the others, then move them in place of the old ones
+  int end = f->nmatches;
+  editorFindRow(f, row, at);
+  int found = f->nmatches - end;
+  if (found) {
+    struct findMatch *tmp = malloc(sizeof(struct findMatch) * found);
+    if (tmp == NULL) die("malloc");
+    memcpy(tmp, &f->matches[end], sizeof(struct findMatch) * found);
+    memmove(&f->matches[lo + found], &f->matches[hi], sizeof(struct findMatch) * (end - hi));
+    memcpy(&f->matches[lo], tmp, sizeof(struct findMatch) * found);
+    free(tmp);
+  } else
+    memmove(&f->matches[lo], &f->matches[hi], sizeof(struct findMatch) * (end - hi));
+  f->nmatches = end - (hi - lo) + found;
+  f->current = -1;
+}
 
-  FILE *fp = fopen(filename, "r");
-  if (!fp) die("fopen");
+// Renumbers the matches of rows "at" and after for n inserted rows (n < 0: -n deleted rows,
+// whose matches are dropped)
+void editorFindShiftRows(int at, int n) {
+  struct findState *f = &E.find;
+  int lo = editorFindRowMatches(at);
+  int hi = (n < 0) ? editorFindRowMatches(at - n) : lo;
+  if (hi > lo) memmove(&f->matches[lo], &f->matches[hi], sizeof(struct findMatch) * (f->nmatches - hi));
+  f->nmatches -= hi - lo;
+  for (int i = lo; i < f->nmatches; i++)
+    f->matches[i].row += n;
+  f->current = -1;
+}
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 && (line[linelen-1] == '\n' || line[linelen-1]=='\r'))
-      linelen--;
-    editorInsertRow(E.numrows, line, linelen);
+// Makes query the search and collects its matches
+// When a literal query extends the previous one, it can only occur where that one did: those
+// positions are checked instead of searching the buffer again
+void editorFindSetQuery(char *query) {
+  struct findState *f = &E.find;
+  int qlen = strlen(query);
+  // An empty query has no matches to narrow down (see editorFindText())
+  int narrow = f->query && !f->use_regex && f->qlen > 0 && qlen >= f->qlen && !memcmp(query, f->query, f->qlen);
+  if (f->query && qlen == f->qlen && !strcmp(query, f->query)) return; // same query (arrow keys)
+
+  LARGE_INTEGER t0, t1, freq;
+  QueryPerformanceCounter(&t0);
+  free(f->query);
+  f->query = strdup(query);
+  f->qlen = qlen;
+  f->error = NULL;
+  if (f->use_regex) {
+    editorRegexFree(f->re);
+    f->re = editorRegexCompile(query, &f->error);
+  } else if (qlen >= FIND_BMH_MIN) {
+    for (int c = 0; c < 256; c++) f->skip[c] = qlen;
+    for (int i = 0; i < qlen - 1; i++) f->skip[(unsigned char)query[i]] = qlen - 1 - i;
   }
-  free(line);
-  fclose(fp);
-  E.dirty = 0;
-}
 
-void editorSave() {
-  if (E.filename == NULL) {
-    E.filename = editorPrompt("Save as: %s (ESC to cancel)", 0, NULL);
-    if (E.filename == NULL) {
-      editorSetStatusMessage("Save aborted");
-      return;
+  if (narrow) {
+    int kept = 0;
+    int at = -1;
+    erow *row = NULL;
+    for (int i = 0; i < f->nmatches; i++) {
+      struct findMatch *m = &f->matches[i];
+      if (m->row != at) row = editorRow(at = m->row);
+      if (m->cx + qlen > row->size) continue;
+      int j = 0;
+      while (j < qlen && ROW_CHAR(row, m->cx + j) == query[j]) j++;
+      if (j < qlen) continue;
+      m->len = qlen;
+      f->matches[kept++] = *m;
     }
-    editorSelectSyntaxHighlight(); // recompute syntax style when new filename is saved
+    f->nmatches = kept;
+  } else if (qlen == 0 && !f->use_regex) {
+    f->nmatches = 0;
+  } else if (E.numrows >= FIND_PARALLEL_ROWS) {
+    f->nmatches = 0;
+    if (!editorFindParallel()) {
+      // Cancelled by a keypress: the next call searches again
+      f->nmatches = 0;
+      free(f->query);
+      f->query = NULL;
+    }
+  } else {
+    f->nmatches = 0;
+    int at = 0;
+    for (erow *row = editorRowFirst(); row; row = editorRowNext(row), at++)
+      editorFindRow(f, row, at);
   }
+  f->current = -1;
+  QueryPerformanceCounter(&t1);
+  QueryPerformanceFrequency(&freq);
+  f->ms = (double)(t1.QuadPart - t0.QuadPart) * 1000.0 / freq.QuadPart;
+}
 
-  int len;
-  char *buf = editorRowsToString(&len);
+// Drops the search and its matches
+void editorFindReset() {
+  free(E.find.query);
+  free(E.find.matches);
+  free(E.find.starts);
+  free(E.find.ends);
+  free(E.find.scratch);
+  editorRegexFree(E.find.re);
+  E.find.query = NULL;
+  E.find.matches = NULL;
+  E.find.starts = NULL;
+  E.find.ends = NULL;
+  E.find.startscap = 0;
+  E.find.scratch = NULL;
+  E.find.scratchcap = 0;
+  E.find.re = NULL;
+  E.find.error = NULL;
+  E.find.nmatches = E.find.cap = 0;
+  E.find.current = -1;
+}
 
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644); // Open file - read/write, create if doesn't exist, w/ file permissions 0644
-  if (fd != -1) { // valid file open
-    // Change file size to len (we do this before write instead of w/ open flag to save a bit from failed write)
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
-    }
-    close(fd);
+// Sets from..to to the next run of screen columns of row covered by matches, starting at
+// E.find.matches[*m] and merging overlapping ones; from = to = len when no match is left on screen
+void editorFindNextRun(int *m, erow *row, int filerow, int len, int *from, int *to) {
+  struct findState *f = &E.find;
+  int found = 0;
+  *from = *to = len;
+  for (; *m < f->nmatches && f->matches[*m].row == filerow; (*m)++) {
+    int rx = editorRowCxToRx(row, f->matches[*m].cx) - E.coloff;
+    int rx_end = editorRowCxToRx(row, f->matches[*m].cx + f->matches[*m].len) - E.coloff;
+    if (rx_end <= 0) continue; // left of the screen
+    if (rx >= len || (found && rx > *to)) break;
+    if (!found) *from = (rx < 0) ? 0 : rx;
+    if (!found || rx_end > *to) *to = rx_end;
+    found = 1;
   }
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  if (*to > len) *to = len;
 }
 
-/*** FIND ***/
+// Writes "match N of M" (or "M matches" when the cursor isn't on one) and the time the search
+// took to buf; returns its length
+int editorFindStatus(char *buf, int size) {
+  const char *mode = E.find.use_regex ? "regex: " : "";
+  if (E.find.error) return snprintf(buf, size, "%s%s", mode, E.find.error);
+  if (E.find.searching) return snprintf(buf, size, "%ssearching...", mode);
+
+  char count[16];
+  int n = E.find.nmatches;
+  int len = snprintf(count, sizeof(count), "%d", n);
+  char grouped[24]; // count w/ thousands separators
+  int g = 0;
+  for (int i = 0; i < len; i++) {
+    if (i && (len - i) % 3 == 0) grouped[g++] = ',';
+    grouped[g++] = count[i];
+  }
+  grouped[g] = '\0';
+
+  if (E.find.current >= 0)
+    return snprintf(buf, size, "%smatch %d of %s (%.1f ms)", mode, E.find.current + 1, grouped, E.find.ms);
+  return snprintf(buf, size, "%s%s match%s (%.1f ms)", mode, grouped, n == 1 ? "" : "es", E.find.ms);
+}
 
 // Searches at each keypress
 void editorFindCallback(char *query, int key) {
-  static int last_match = -1;
-  static int direction = 1;
+  // ESC drops the search; Enter keeps its matches highlighted (until ESC or the next search)
+  if (key == ESC) {
+    editorFindReset();
+    return;
+  } else if (key == '\r')
+    return;
+  if (key == CTRL_KEY('r')) {
+    // Toggle regex mode and search again
+    E.find.use_regex = !E.find.use_regex;
+    free(E.find.query);
+    E.find.query = NULL;
+  }
 
-  // Highlight reset vars
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
+  editorFindSetQuery(query);
+  struct findState *f = &E.find;
+  if (f->nmatches == 0) return;
 
-  // Undo previous highlight at each change in the search (including cancelling) 
-  if (saved_hl) {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
-  }
+  // Arrows step through the matches, wrapping around in both directions; typing goes back to the first
+  if ((key == ARROW_RIGHT || key == ARROW_DOWN) && f->current != -1)
+    f->current = (f->current + 1) % f->nmatches;
+  else if ((key == ARROW_LEFT || key == ARROW_UP) && f->current != -1)
+    f->current = (f->current + f->nmatches - 1) % f->nmatches;
+  else
+    f->current = 0;
 
-  if (key == '\r' || key == ESC) {
-    last_match = -1;
-    direction = 1;
-    return;
-  } else if (key == ARROW_RIGHT || key == ARROW_DOWN)
-    direction = 1;
-  else if (key == ARROW_LEFT || key == ARROW_UP)
-    direction = -1;
-  else {
-    last_match = -1;
-    direction = 1;
-  }
-
-  if (last_match == -1) direction = 1;
-  int current = last_match;
-  for (int i = 0; i < E.numrows; i++) {
-    // search forward by default, search backward when left or up is pressed
-    current += direction;
-    // wrap around behavior in both directions
-    if (current == -1) current = E.numrows-1;
-    else if (current == E.numrows) current = 0;
-
-
-    erow *row = &E.row[current];
-    char *match = strstr(row->render, query); // finds index of substring
-    if (match) {
-      last_match = current;
-      E.cy = current;
-      E.cx = editorRowRxToCx(row, match - row->render);
-      E.rowoff = E.numrows;
-
-      // Store OG highlighting before we change highlighting
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query)); // highlight match
-      break;
-    }
-  }
+  struct findMatch *m = &f->matches[f->current];
+  editorScrollTo(m->row, m->cx);
 }
 
 // Creates prompt and begins search query
@@ -689,7 +3230,8 @@ void editorFind() {
   int saved_coloff = E.coloff;
   int saved_rowoff = E.rowoff;
 
-  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", 0, editorFindCallback);
+  editorFindReset();
+  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter, Ctrl-R: regex)", 0, 0, editorFindCallback);
 
   if (query) {
     free(query);
@@ -701,6 +3243,105 @@ void editorFind() {
   }
 }
 
+// Replaces the n matches ms (sorted like E.find.matches) w/ "with", rebuilding each row once
+// Overlapping matches are dropped from ms; returns how many were replaced
+// The search is dropped: keeping its index current row by row would cost more than the replace
+int editorReplaceMatches(struct findMatch *ms, int n, char *with, int withlen, int record_undo_event) {
+  editorFindReset();
+  int kept = 0;
+  int oldlen = 0;
+  for (int i = 0; i < n; i++) {
+    if (kept && ms[kept-1].row == ms[i].row && ms[i].cx < ms[kept-1].cx + ms[kept-1].len) continue;
+    ms[kept++] = ms[i];
+    oldlen += ms[i].len;
+  }
+  if (kept == 0) return 0;
+
+  char *old = malloc(oldlen);
+  struct rowEdit *edits = malloc(sizeof(struct rowEdit) * kept);
+  if (old == NULL || edits == NULL) die("malloc");
+  int o = 0;
+  for (int i = 0; i < kept; ) {
+    erow *row = editorRow(ms[i].row);
+    char *chars = editorRowChars(row);
+    int k = 0;
+    for (; i + k < kept && ms[i+k].row == ms[i].row; k++) {
+      struct findMatch *m = &ms[i+k];
+      memcpy(&old[o], &chars[m->cx], m->len);
+      o += m->len;
+      edits[k].cx = m->cx;
+      edits[k].len = m->len;
+      edits[k].text = with;
+      edits[k].textlen = withlen;
+    }
+    editorRowSplice(row, edits, k);
+    i += k;
+  }
+  if (record_undo_event)
+    addUndoReplace(ms, kept, old, oldlen, with, withlen);
+  free(old);
+  free(edits);
+  return kept;
+}
+
+// Finds w/ the search prompt, then replaces the current match or all of them
+void editorReplace() {
+  int saved_cx = E.cx;
+  int saved_cy = E.cy;
+  int saved_coloff = E.coloff;
+  int saved_rowoff = E.rowoff;
+
+  editorFindReset();
+  char *query = editorPrompt("Replace: %s (Use ESC/Arrows/Enter, Ctrl-R: regex)", 0, 0, editorFindCallback);
+  char *with = NULL;
+  if (query && E.find.nmatches)
+    with = editorPrompt("Replace with: %s (ESC to cancel)", 0, 1, NULL);
+  int key = ESC;
+  if (with) {
+    editorSetStatusMessage("Replace: A = all, Enter = this match, ESC = cancel");
+    editorScheduleRefresh();
+    key = editorReadKey();
+  }
+
+  struct findState *f = &E.find;
+  int n = 0;
+  struct findMatch *ms = NULL;
+  if (key == 'a' || key == 'A') {
+    // Take over the match list
+    ms = f->matches;
+    n = f->nmatches;
+    f->matches = NULL;
+    f->nmatches = f->cap = 0;
+  } else if (key == '\r') {
+    ms = malloc(sizeof(struct findMatch));
+    if (ms == NULL) die("malloc");
+    ms[0] = f->matches[f->current >= 0 ? f->current : 0];
+    n = 1;
+  }
+
+  if (n) {
+    LARGE_INTEGER t0, t1, freq;
+    QueryPerformanceCounter(&t0);
+    n = editorReplaceMatches(ms, n, with, strlen(with), 1);
+    QueryPerformanceCounter(&t1);
+    QueryPerformanceFrequency(&freq);
+    E.cy = ms[0].row;
+    E.cx = ms[0].cx + (n == 1 ? strlen(with) : 0);
+    editorSetStatusMessage("Replaced %d match%s (%.1f ms)", n, n == 1 ? "" : "es",
+                           (double)(t1.QuadPart - t0.QuadPart) * 1000.0 / freq.QuadPart);
+  } else {
+    if (query && f->nmatches == 0) editorSetStatusMessage("No matches");
+    editorFindReset();
+    E.cx = saved_cx;
+    E.cy = saved_cy;
+    E.coloff = saved_coloff;
+    E.rowoff = saved_rowoff;
+  }
+  free(ms);
+  free(query);
+  free(with);
+}
+
 // Jumps to line number at each press
 void editorJumpCallback(char *query, int key) {
   if (key == '\r' || key == ESC)
@@ -709,8 +3350,7 @@ void editorJumpCallback(char *query, int key) {
   E.cy = atoi(query)-1;
   E.cy = E.cy < 0 ? 0 : E.cy;
   E.cy = E.cy > E.numrows ? E.numrows : E.cy;
-  E.cx = 0;
-  E.rowoff = E.numrows;
+  editorScrollTo(E.cy, 0);
 
   }
 
@@ -721,7 +3361,7 @@ void editorJump() {
   int saved_coloff = E.coloff;
   int saved_rowoff = E.rowoff;
 
-  char *query = editorPrompt("Jump to line: #%s", 1, editorJumpCallback);
+  char *query = editorPrompt("Jump to line: #%s", 1, 0, editorJumpCallback);
   
   if (query) {
     free(query);
@@ -787,8 +3427,10 @@ char *selectionToString(int *buflen) {
     return NULL;
   }
   struct textSelection canon = canonicalSelection(E.selection);
+  for (int r = canon.heady; r <= canon.taily && r < E.numrows; r++)
+    editorRowChars(editorRow(r));
   // Prevent selecting past final character
-  if (E.row[canon.taily].size == canon.tailx)
+  if (editorRow(canon.taily)->size == canon.tailx)
     canon.tailx--;
 
   int totlen = 0;
@@ -798,35 +3440,35 @@ char *selectionToString(int *buflen) {
     totlen = canon.tailx - canon.headx + 2; // +1 inclusive, +1 0 term
     *buflen = totlen;
     char *buf = malloc(totlen);
-    memcpy(buf, &E.row[canon.heady].chars[canon.headx], totlen-1);
+    memcpy(buf, &editorRow(canon.heady)->chars[canon.headx], totlen-1);
     buf[totlen-1] = 0;
     return buf;
   }
   // Multiline selection:
-  totlen = E.row[canon.heady].size - canon.headx + 2; //+2 for \r\n
+  totlen = editorRow(canon.heady)->size - canon.headx + 2; //+2 for \r\n
   for (int r = canon.heady+1; r < canon.taily; r++)
-    totlen += E.row[r].size + 2; // +2 for \r\n
+    totlen += editorRow(r)->size + 2; // +2 for \r\n
   totlen += canon.tailx + 2; // +1 for inclusive, +1 for 0 terminator
   
   *buflen = totlen;
 
   char *buf = malloc(totlen);
   char *p = buf;
-  memcpy(p, &E.row[canon.heady].chars[canon.headx], E.row[canon.heady].size - canon.headx);
-  p += E.row[canon.heady].size - canon.headx;
+  memcpy(p, &editorRow(canon.heady)->chars[canon.headx], editorRow(canon.heady)->size - canon.headx);
+  p += editorRow(canon.heady)->size - canon.headx;
   *p = '\r';
   p++;
   *p = '\n';
   p++;
   for (int i = canon.heady+1; i < canon.taily; i++) {
-    memcpy(p, E.row[i].chars, E.row[i].size);
-    p += E.row[i].size;
+    memcpy(p, editorRow(i)->chars, editorRow(i)->size);
+    p += editorRow(i)->size;
     *p = '\r';
     p++;
     *p = '\n';
     p++;
   }
-  memcpy(p, E.row[canon.taily].chars, canon.tailx+1);
+  memcpy(p, editorRow(canon.taily)->chars, canon.tailx+1);
   p += canon.tailx+1;
   *p = 0;
 
@@ -840,7 +3482,7 @@ void deleteSelection(int record_undo_event) {
   struct textSelection sel = canonicalSelection(E.selection);
 
   // Get size of new row: remaining head row + remaining tail row
-  int tail_size = E.row[sel.taily].size - sel.tailx -1;
+  int tail_size = editorRow(sel.taily)->size - sel.tailx -1;
   tail_size = tail_size < 0 ? 0 : tail_size;
   int new_row_size = sel.headx + tail_size;
 
@@ -848,46 +3490,43 @@ void deleteSelection(int record_undo_event) {
     int selectlen = 0;
     char *selecttext = selectionToString(&selectlen);
     addUndoEvent(EVENT_DELETE_STRING, sel.heady, sel.headx, selecttext, selectlen-1);
+    free(selecttext);
   }
 
-  // Realloc old row char, reset size
-  if (new_row_size <= E.row[sel.heady].size) {
-    // put tail first and then realloc
-    // the strings may overlap: we must use memmove
-    if (tail_size > 0)
-      memmove(&E.row[sel.heady].chars[sel.headx], &E.row[sel.taily].chars[sel.tailx+1], tail_size);
-    E.row[sel.heady].chars = realloc(E.row[sel.heady].chars, new_row_size);
+  editorRowChars(editorRow(sel.heady));
+  editorRowChars(editorRow(sel.taily));
+  if (editorRow(sel.taily)->flags & ROW_CHARS_VIEW) {
+    // Tail text is read-only and stays valid: cut head and append the tail's remainder straight from it
+    // (head becomes a view of it when nothing of the head row is kept)
+    editorRowTruncate(editorRow(sel.heady), sel.headx);
+    editorRowAppendView(editorRow(sel.heady), &editorRow(sel.taily)->chars[sel.tailx+1], tail_size);
   } else {
-    // Only way new one could be bigger is if its multiline:
-    // no overlap!
-    E.row[sel.heady].chars = realloc(E.row[sel.heady].chars, new_row_size);
-    if (tail_size > 0)
-      memcpy(&E.row[sel.heady].chars[sel.headx], &E.row[sel.taily].chars[sel.tailx+1], tail_size);
+    // Realloc old row char, reset size
+    erow *head = editorRow(sel.heady);
+    editorRowMaterialize(head);
+    if (new_row_size <= head->size) {
+      // put tail first; the buffer keeps its size class
+      // the strings may overlap: we must use memmove
+      if (tail_size > 0)
+        memmove(&head->chars[sel.headx], &editorRow(sel.taily)->chars[sel.tailx+1], tail_size);
+    } else {
+      // Only way new one could be bigger is if its multiline:
+      // no overlap!
+      head->chars = editorArenaRealloc(head->chars, head->cap, new_row_size, &head->cap);
+      if (tail_size > 0)
+        memcpy(&head->chars[sel.headx], &editorRow(sel.taily)->chars[sel.tailx+1], tail_size);
+    }
+    head->size = new_row_size;
+    head->gap = new_row_size;
+
+    // Set row char updateRow()
+    editorUpdateRow(head);
   }
-  E.row[sel.heady].size = new_row_size;
   E.cx = sel.headx;
   E.cy = sel.heady;
 
-  E.row[sel.heady].size = new_row_size;
-
-  // Set row char updateRow()
-  editorUpdateRow(&E.row[sel.heady]);
-
-  int gap = sel.taily - sel.heady;
-  // Delete all rows but head shift all other rows back
-  int r;
-  for (r = sel.heady+1; r <= sel.taily; r++) {
-    // Free each row
-    // Afterward, shift rows down & reduce E.row's size
-    editorFreeRow(&E.row[r]);
-    if (r+gap < E.numrows)
-      E.row[r] = E.row[r+gap];
-  }
-  while(r < E.numrows-gap) {
-    E.row[r] = E.row[r+gap];
-    r++;
-  }
-  E.numrows -= gap;
+  // Delete all rows but head, shifting the following rows back in one go
+  editorDelRows(sel.heady + 1, sel.taily - sel.heady);
 
   free(E.selection);
   E.selection = NULL;
@@ -919,27 +3558,60 @@ void copySelectionToClipboard() {
 
 /*** UNDO/REDO ***/
 
+// Copies text into the event's own buffer, which is reused (and only grows) across events
+void undoEventSetText(struct undoEvent *event, const char *text, int textlen) {
+  if (textlen > event->textcap) {
+    char *new = realloc(event->text, textlen);
+    if (new == NULL) die("realloc");
+    event->text = new;
+    event->textcap = textlen;
+  }
+  if (textlen) memcpy(event->text, text, textlen);
+  event->textlen = textlen;
+}
+
+// Copies the n matches of a replace and the text that replaced them into the event's own buffers,
+// reused like its text
+void undoEventSetReplace(struct undoEvent *event, struct findMatch *ms, int n, const char *with, int withlen) {
+  if (n > event->matchcap) {
+    struct findMatch *new = realloc(event->matches, sizeof(struct findMatch) * n);
+    if (new == NULL) die("realloc");
+    event->matches = new;
+    event->matchcap = n;
+  }
+  if (withlen > event->withcap) {
+    char *new = realloc(event->with, withlen);
+    if (new == NULL) die("realloc");
+    event->with = new;
+    event->withcap = withlen;
+  }
+  if (n) memcpy(event->matches, ms, sizeof(struct findMatch) * n);
+  if (withlen) memcpy(event->with, with, withlen);
+  event->nmatches = n;
+  event->withlen = withlen;
+}
+
 void addUndoEvent(int eventType, int cy, int cx, char* text, int textlen) {
   // TODO: Handle non-singular buffer!!!
   // Right now, we are just overwriting the existing element on the buff
   E.undoBuf->eventType = eventType;
   E.undoBuf->cy = cy;
   E.undoBuf->cx = cx;
-  if (E.undoBufSize > 0)
-    free(E.undoBuf->text);
-  if (textlen == 0 || text == NULL) {
-    E.undoBuf->text = NULL;
-    E.undoBuf->textlen = 0;
-  } else {
-    E.undoBuf->text = malloc(textlen);
-    memcpy(E.undoBuf->text, text, textlen);
-    E.undoBuf->textlen = textlen;
-  }
+  E.undoBuf->nmatches = 0;
+  E.undoBuf->withlen = 0;
+  undoEventSetText(E.undoBuf, text, text ? textlen : 0);
   E.undoBufSize = 1;
+}
 
-  char* textstr = malloc(textlen+1);
-  memcpy(textstr, text, textlen);
-  textstr[textlen] = 0;
+// Records a replace of the n matches ms (see editorReplaceMatches()) as one event
+// old holds the replaced texts back to back
+void addUndoReplace(struct findMatch *ms, int n, char *old, int oldlen, char *with, int withlen) {
+  E.undoBuf->eventType = EVENT_REPLACE;
+  E.undoBuf->cy = ms[0].row;
+  E.undoBuf->cx = ms[0].cx;
+  undoEventSetText(E.undoBuf, old, oldlen);
+  undoEventSetReplace(E.undoBuf, ms, n, with, withlen);
+  E.undoBufSize = 1;
 }
 
 void editorUndo() {
@@ -1022,6 +3694,33 @@ void editorUndo() {
         editorInsertText(event.text, event.textlen, 0);
         editorSetStatusMessage("UNDO DELETE: INSERTED %d CHARS", event.textlen);
         break;
+      case EVENT_REPLACE: {
+        // Put the old texts back where the replacements ended up, one row at a time
+        editorFindReset();
+        struct rowEdit *edits = malloc(sizeof(struct rowEdit) * event.nmatches);
+        if (edits == NULL) die("malloc");
+        char *old = event.text;
+        for (int i = 0; i < event.nmatches; ) {
+          int at = event.matches[i].row;
+          int k = 0;
+          int shift = 0; // growth of the row from the replacements before this one
+          for (; i < event.nmatches && event.matches[i].row == at; i++, k++) {
+            struct findMatch *m = &event.matches[i];
+            edits[k].cx = m->cx + shift;
+            edits[k].len = event.withlen;
+            edits[k].text = old;
+            edits[k].textlen = m->len;
+            shift += event.withlen - m->len;
+            old += m->len;
+          }
+          editorRowSplice(editorRow(at), edits, k);
+        }
+        free(edits);
+        E.cx = event.cx;
+        E.cy = event.cy;
+        editorSetStatusMessage("UNDO REPLACE: %d MATCHES", event.nmatches);
+        break;
+      }
       default:
         editorSetStatusMessage("UNDO NULL!!!");
         break;
@@ -1039,25 +3738,73 @@ void editorRedo() {
 
 /*** APPEND BUFFER ***/
 
+// Makes room for n more bytes; capacity doubles, so a buffer that is reused (see abReset())
+// stops allocating once it has held its largest frame
+void abGrow(struct abuf *ab, int n) {
+  if (ab->len + n <= ab->cap) return;
+  int cap = ab->cap ? ab->cap * 2 : ABUF_MIN_CAP;
+  while (cap < ab->len + n) cap *= 2;
+  char *new = realloc(ab->b, cap);
+  if (new == NULL) die("realloc");
+  ab->b = new;
+  ab->cap = cap;
+}
+
 // Append string s of length len to buffer
 void abAppend(struct abuf *ab, const char *s, int len) {
-  char *new = realloc(ab->b, ab->len+len);
-  
-  if (new == NULL) return;
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
+  abGrow(ab, len);
+  memcpy(&ab->b[ab->len], s, len);
   ab->len += len;
 }
 
+void abAppendByte(struct abuf *ab, char c) {
+  if (ab->len == ab->cap) abGrow(ab, 1);
+  ab->b[ab->len++] = c;
+}
+
+// Appends n (>= 0) in decimal
+void abAppendNum(struct abuf *ab, int n) {
+  char digits[12];
+  int i = sizeof(digits);
+  do {
+    digits[--i] = '0' + n % 10;
+    n /= 10;
+  } while (n);
+  abAppend(ab, &digits[i], sizeof(digits) - i);
+}
+
+// Appends the SGR sequence ESC[nm
+void abAppendSgr(struct abuf *ab, int n) {
+  abAppend(ab, "\x1b[", 2);
+  abAppendNum(ab, n);
+  abAppendByte(ab, 'm');
+}
+
+// Appends the sequence moving the cursor to (1-based) row, col
+void abAppendCursor(struct abuf *ab, int row, int col) {
+  abAppend(ab, "\x1b[", 2);
+  abAppendNum(ab, row);
+  abAppendByte(ab, ';');
+  abAppendNum(ab, col);
+  abAppendByte(ab, 'H');
+}
+
+// Empties the buffer, keeping its memory for the next use
+void abReset(struct abuf *ab) {
+  ab->len = 0;
+}
+
 // Destructs append buffer
 void abFree(struct abuf *ab) {
   free(ab->b);
+  ab->b = NULL;
+  ab->len = ab->cap = 0;
 }
 
 /*** INPUT ***/
 
 // Opens prompt and handles text input: if callback is not NULL, performs at each keypress
-char *editorPrompt(char *prompt, int numeric, void (*callback)(char *, int)) {
+char *editorPrompt(char *prompt, int numeric, int allow_empty, void (*callback)(char *, int)) {
   size_t bufsize = 128;
   char *buf = malloc(bufsize);
 
@@ -1065,9 +3812,9 @@ char *editorPrompt(char *prompt, int numeric, void (*callback)(char *, int)) {
   buf[0] = '\0';
 
   while (1) {
-    // Loop until ENTER is pressed (w/o empty inputs)
+    // Loop until ENTER is pressed (w/o empty inputs, unless allow_empty)
     editorSetStatusMessage(prompt, buf);
-    editorRefreshScreen();
+    editorScheduleRefresh();
 
     int c = editorReadKey();
     if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
@@ -1079,7 +3826,7 @@ char *editorPrompt(char *prompt, int numeric, void (*callback)(char *, int)) {
       free(buf);
       return NULL;
     } else if (c == '\r') {
-      if (buflen != 0) {
+      if (buflen != 0 || allow_empty) {
         editorSetStatusMessage("");
         if (callback) callback(buf, c);
         return buf;
@@ -1101,7 +3848,7 @@ char *editorPrompt(char *prompt, int numeric, void (*callback)(char *, int)) {
 }
 
 void editorMoveCursor(int key, int shift_pressed) {
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  erow *row = (E.cy >= E.numrows) ? NULL : editorRow(E.cy);
 
   // BEFORE WE MOVE: if shift is pressed and no selection exists, create new selection
   if (shift_pressed && E.selection == NULL) {
@@ -1116,7 +3863,7 @@ void editorMoveCursor(int key, int shift_pressed) {
         E.cx--;
       // if scroll left at 0, go to end of previous line
       else if (E.cy > 0)
-        E.cx = E.row[--E.cy].size;
+        E.cx = editorRow(--E.cy)->size;
       break;
     case ARROW_RIGHT:
       // Only scroll right until end-of-line
@@ -1148,7 +3895,7 @@ void editorMoveCursor(int key, int shift_pressed) {
   }
 
   // Snap cursor to end-of-line if it is past it
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  row = (E.cy >= E.numrows) ? NULL : editorRow(E.cy);
   int rowlen = row ? row->size : 0;
   if (E.cx > rowlen)
     E.cx = rowlen;
@@ -1156,15 +3903,38 @@ void editorMoveCursor(int key, int shift_pressed) {
 
 int editorReadEvents(HANDLE handle, char *pc, int n_records, DWORD* ctrl_key_states) {
   static DWORD prev_mouse_button_state = 0;
-  DWORD wait_ret = WaitForSingleObject(handle, 100);
+  // Don't sleep while highlighting has catching up to do: it runs in the gaps between events
+  // The highlight worker finishing a batch wakes us up too, and so does a refresh coming due
+  HANDLE handles[2] = {handle, E.hl_worker.done_event};
+  DWORD timeout = (E.hl_valid_rows < E.numrows || E.hl_pending) ? 0 : 100;
+  DWORD refresh_wait = editorRefreshWait();
+  if (refresh_wait < timeout) timeout = refresh_wait;
+  DWORD wait_ret = WaitForMultipleObjects(2, handles, FALSE, timeout);
+  if (wait_ret == WAIT_OBJECT_0 + 1) {
+    if (editorHighlightCollect()) editorScheduleRefresh(); // draw the rows it highlighted
+    return 0;
+  }
   if (wait_ret == WAIT_TIMEOUT) {
+    editorHighlightIdle();
     return 0; // timeout
   }
   else if (wait_ret == WAIT_OBJECT_0) {
-    INPUT_RECORD *record_arr = malloc(sizeof(INPUT_RECORD)*n_records);
+    INPUT_RECORD record_arr[INPUT_MAX_RECORDS];
+    if (n_records > INPUT_MAX_RECORDS) n_records = INPUT_MAX_RECORDS;
     // records are in buffer
+    // Only one event is taken, or the key presses of an escape sequence: whatever is queued
+    // behind it (a key release, another ESC, mouse events...) stays for the next read instead of
+    // being dropped along w/ it
     long unsigned int nread;
-    if(!ReadConsoleInput(E.in_handle, record_arr, n_records, &nread) || nread < 1)
+    DWORD nrecords = 1;
+    if (PeekConsoleInput(E.in_handle, record_arr, n_records, &nread) && nread > 1 &&
+        record_arr[0].EventType == KEY_EVENT && record_arr[0].Event.KeyEvent.bKeyDown &&
+        record_arr[0].Event.KeyEvent.uChar.AsciiChar == ESC)
+      while (nrecords < nread && record_arr[nrecords].EventType == KEY_EVENT &&
+             record_arr[nrecords].Event.KeyEvent.bKeyDown &&
+             record_arr[nrecords].Event.KeyEvent.uChar.AsciiChar != ESC)
+        nrecords++;
+    if(!ReadConsoleInput(E.in_handle, record_arr, nrecords, &nread) || nread < 1)
       die("read"); // read failed
     
     int retval = nread;
@@ -1191,7 +3961,7 @@ int editorReadEvents(HANDLE handle, char *pc, int n_records, DWORD* ctrl_key_sta
           if (curr_mouse_button_state & FROM_LEFT_1ST_BUTTON_PRESSED) {
             E.cy = record_arr[i].Event.MouseEvent.dwMousePosition.Y + E.rowoff;
             E.rx = record_arr[i].Event.MouseEvent.dwMousePosition.X + E.coloff;
-            E.cx = editorRowRxToCx(&E.row[E.cy], E.rx);
+            E.cx = editorRowRxToCx(editorRow(E.cy), E.rx);
             if (prev_mouse_button_state & curr_mouse_button_state & FROM_LEFT_1ST_BUTTON_PRESSED) {
               if (E.selection == NULL) {
                 E.selection = malloc(sizeof(struct textSelection));
@@ -1208,7 +3978,7 @@ int editorReadEvents(HANDLE handle, char *pc, int n_records, DWORD* ctrl_key_sta
           }
 
           prev_mouse_button_state = curr_mouse_button_state;
-          editorRefreshScreen();
+          editorScheduleRefresh(); // drawn once the events queued behind it are applied too
           retval = 0;
           break;
         case WINDOW_BUFFER_SIZE_EVENT:
@@ -1216,15 +3986,13 @@ int editorReadEvents(HANDLE handle, char *pc, int n_records, DWORD* ctrl_key_sta
           if(!getWindowSize(&E.screenrows, &E.screencols)) die("getWindowSize");
           E.screenrows -= 2; // 2 info rows at bottom
           if (E.screenrows < 0) E.screenrows = 2;
-          editorRefreshScreen();
+          editorScheduleRefresh();
           retval =  0;
           break;
         default:
           retval = 0;
       }
     }
-    free(record_arr);
-
     return retval;
   } else {
     // wait failed
@@ -1232,16 +4000,29 @@ int editorReadEvents(HANDLE handle, char *pc, int n_records, DWORD* ctrl_key_sta
   }
 }
 
+// Returns whether a keypress is waiting in the input buffer, w/o consuming it
+int editorKeyPending() {
+  INPUT_RECORD records[16];
+  DWORD nread;
+  if (!PeekConsoleInput(E.in_handle, records, 16, &nread)) return 0;
+  for (DWORD i = 0; i < nread; i++)
+    if (records[i].EventType == KEY_EVENT && records[i].Event.KeyEvent.bKeyDown) return 1;
+  return 0;
+}
+
 // TODO: Refactor this and editorReadEvents
 // Blocks until a single keypress is read in
 // Returns an int because escape sequences will be mapped to a single value rather than multiple chars
 int editorReadKey() {
   int nread;
-  char buf[6];
+  char buf[INPUT_MAX_RECORDS];
   DWORD ctrl_key_states = 0;
 
   // TODO: Figure out how to distinguish shift + Ctrl commands
-  while((nread = editorReadEvents(E.in_handle, buf, 6, &ctrl_key_states)) == 0); // read until non-timeout event
+  // Read until non-timeout event; the screen is refreshed in between, once input has run dry
+  do {
+    editorRefreshIfDue();
+  } while((nread = editorReadEvents(E.in_handle, buf, INPUT_MAX_RECORDS, &ctrl_key_states)) == 0);
 
   char c = buf[0];
 
@@ -1346,7 +4127,7 @@ void editorProcessEvent() {
     case CTRL_ARROW_RIGHT:
     case END_KEY:
       if (E.cy < E.numrows)
-        E.cx = E.row[E.cy].size;
+        E.cx = editorRow(E.cy)->size;
       break;
 
     case CTRL_KEY('f'):
@@ -1357,6 +4138,10 @@ void editorProcessEvent() {
       editorJump();
       break;
 
+    case CTRL_KEY('r'):
+      editorReplace();
+      break;
+
     case CTRL_KEY('a'):
       free(E.selection);
       E.selection = malloc(sizeof(struct textSelection));
@@ -1428,8 +4213,20 @@ void editorProcessEvent() {
       editorMoveCursor(c + (ARROW_UP-SHIFT_ARROW_UP), 1);
       break;
 
-    case CTRL_KEY('l'): // Refresh screen - already done after any keypress
-    case ESC:          // Any escape sequence we aren't processing (default return of editorReadKey())
+    case CTRL_KEY('t'):
+      editorArenaStats();
+      break;
+
+    case CTRL_KEY('g'):
+      editorFrameStats();
+      break;
+
+    case CTRL_KEY('l'): // Refresh screen - already done after any keypress, this one repaints it all
+      editorFrameInvalidate();
+      break;
+
+    case ESC: // Also any escape sequence we aren't processing (default return of editorReadKey())
+      editorFindReset(); // stop highlighting the last search
       break;
 
     default:
@@ -1462,7 +4259,7 @@ void editorPasteFromClipboard() {
 void editorScroll() {
   E.rx = 0;
   if (E.cy < E.numrows)
-    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    E.rx = editorRowCxToRx(editorRow(E.cy), E.cx);
 
   if (E.cy < E.rowoff) {
     E.rowoff = E.cy;
@@ -1476,6 +4273,14 @@ void editorScroll() {
   }
 }
 
+// Moves the cursor to (row, cx) and brings row to the top of the screen
+// (editorScroll() only scrolls as far as it takes to get the cursor on screen)
+void editorScrollTo(int row, int cx) {
+  E.cy = row;
+  E.cx = cx;
+  E.rowoff = row;
+}
+
 // Return screen to blank
 void clearScreen() {
   // NOTE: VT100 is largely supported by terminals, ncurses library supports more terminals
@@ -1484,13 +4289,199 @@ void clearScreen() {
   write(STDOUT_FILENO, "\x1b[H",  3); // Reposition cursor at top
 }
 
-// Draw text on screen row-by-row
-void editorDrawRows(struct abuf *ab) {
- 
+// Sizes the frame to the screen (text rows + status bar + message bar)
+// A new size leaves the terminal's contents unknown, so the next flush repaints everything
+void editorFrameResize() {
+  struct frame *fr = &E.frame;
+  int rows = E.screenrows + 2;
+  int cols = E.screencols;
+  if (fr->cells && rows == fr->rows && cols == fr->cols) return;
+  free(fr->cells);
+  free(fr->next);
+  fr->rows = rows;
+  fr->cols = cols;
+  fr->cells = malloc(sizeof(struct frameCell) * rows * cols);
+  fr->next = malloc(sizeof(struct frameCell) * rows * cols);
+  if (fr->cells == NULL || fr->next == NULL) die("malloc");
+  fr->valid = 0;
+}
+
+// Sets n cells of the frame being drawn, starting at cell, to ch
+void editorFrameFill(struct frameCell *cell, int n, char ch, int color, int attr) {
+  for (int i = 0; i < n; i++) {
+    cell[i].ch = ch;
+    cell[i].color = color;
+    cell[i].attr = attr;
+  }
+}
+
+// Appends what it takes to switch the terminal from colors *color/*attr to those of cell
+void editorFrameSgr(struct abuf *ab, int *color, int *attr, struct frameCell *cell) {
+  if (cell->attr != *attr) {
+    if (cell->attr & FRAME_REVERSE)
+      abAppend(ab, "\x1b[7m", 4);
+    else {
+      abAppend(ab, "\x1b[m", 3); // also resets the color
+      *color = 0;
+    }
+    *attr = cell->attr;
+  }
+  if (cell->color != *color) {
+    abAppendSgr(ab, cell->color ? cell->color : 39); // 39: default text color
+    *color = cell->color;
+  }
+}
+
+// Writes the cells of the drawn frame that differ from the terminal's, then makes it current
+// Each line only gets the span between its first and last changed cell; a blank end of line is
+// erased instead of written
+void editorFrameFlush(struct abuf *ab) {
+  struct frame *fr = &E.frame;
+  int color = -1, attr = -1; // terminal state unknown until the first cell is written
+  int cy = -2; // terminal cursor row (-2: unknown)
+  int cx = -1; // terminal cursor column (-1: unknown)
+
+  for (int y = 0; y < fr->rows; y++) {
+    struct frameCell *line = &fr->next[y * fr->cols];
+    struct frameCell *old = &fr->cells[y * fr->cols];
+    int x0 = 0, x1 = fr->cols - 1;
+    if (fr->valid) {
+      while (x0 < fr->cols && !memcmp(&line[x0], &old[x0], sizeof(struct frameCell))) x0++;
+      if (x0 == fr->cols) continue; // line unchanged
+      while (!memcmp(&line[x1], &old[x1], sizeof(struct frameCell))) x1--;
+    }
+    int blank = fr->cols; // line is blank from here on
+    while (blank > 0 && line[blank-1].ch == ' ' && line[blank-1].color == 0 && line[blank-1].attr == 0) blank--;
+    int to = x1 < blank ? x1 + 1 : blank; // cells written; the rest up to x1 is erased
+
+    if (y == cy && x0 == cx) {
+      // already there
+    } else if (x0 == 0 && y == cy + 1) {
+      abAppend(ab, "\r\n", 2);
+    } else
+      abAppendCursor(ab, y + 1, x0 + 1);
+    if (color == -1) {
+      abAppend(ab, "\x1b[m", 3);
+      color = attr = 0;
+    }
+    for (int x = x0; x < to; ) {
+      // Runs of cells w/ the same colors go out in one append
+      editorFrameSgr(ab, &color, &attr, &line[x]);
+      int k = x + 1;
+      while (k < to && line[k].color == line[x].color && line[k].attr == line[x].attr) k++;
+      abGrow(ab, k - x);
+      for (int i = x; i < k; i++) ab->b[ab->len++] = line[i].ch;
+      x = k;
+    }
+    cy = y;
+    cx = to > x0 ? to : x0;
+    if (cx == fr->cols) cx = -1; // past the last column the cursor waits to wrap
+    if (x1 >= blank) {
+      if (attr != 0 || color != 0) {
+        abAppend(ab, "\x1b[m", 3); // erase w/ default colors
+        color = attr = 0;
+      }
+      abAppend(ab, "\x1b[K", 3); // erase everything right of the end of line
+    }
+  }
+  if (color > 0 || attr > 0) abAppend(ab, "\x1b[m", 3); // leave the terminal w/ default colors
+
+  struct frameCell *swap = fr->cells;
+  fr->cells = fr->next;
+  fr->next = swap;
+  fr->valid = 1;
+}
+
+// Shifts the text rows on the terminal, and in E.frame.cells, by n rows w/ a scroll region, so
+// that only the rows scrolled into view have to be written (n > 0: rowoff grew, text moves up)
+void editorFrameScroll(struct abuf *ab, int n) {
+  struct frame *fr = &E.frame;
+  int rows = E.screenrows;
+  int d = n > 0 ? n : -n;
+  abAppend(ab, "\x1b[m", 3); // rows scrolled in are blank w/ default colors
+  abAppend(ab, "\x1b[1;", 4); // scroll region: the text rows (not the status and message bars)
+  abAppendNum(ab, rows);
+  abAppendByte(ab, 'r');
+  abAppend(ab, "\x1b[", 2);
+  abAppendNum(ab, d);
+  abAppendByte(ab, n > 0 ? 'S' : 'T'); // scroll up / down
+  abAppend(ab, "\x1b[r", 3); // whole screen again
+
+  struct frameCell *text = fr->cells;
+  int keep = (rows - d) * fr->cols;
+  if (n > 0) {
+    memmove(text, &text[d * fr->cols], sizeof(struct frameCell) * keep);
+    editorFrameFill(&text[keep], d * fr->cols, ' ', 0, 0);
+  } else {
+    memmove(&text[d * fr->cols], text, sizeof(struct frameCell) * keep);
+    editorFrameFill(text, d * fr->cols, ' ', 0, 0);
+  }
+}
+
+// Makes the next refresh repaint the whole screen (the terminal's contents are unknown)
+void editorFrameInvalidate() {
+  E.frame.valid = 0;
+}
+
+// Shows how many bytes refreshes wrote to the terminal, and how many screen updates they covered
+void editorFrameStats() {
+  struct frame *fr = &E.frame;
+  editorSetStatusMessage("Output: %ld bytes last refresh, %ld avg over %ld refreshes (%ld updates)",
+    fr->last_bytes, fr->refreshes ? fr->total_bytes / fr->refreshes : 0, fr->refreshes, fr->requests);
+}
+
+// Asks for a refresh once the input waiting has been applied (see editorRefreshIfDue())
+// Any number of requests before it runs make one refresh
+void editorScheduleRefresh() {
+  E.frame.pending = 1;
+  E.frame.requests++;
+}
+
+// Returns how many ms a requested refresh has to wait for the frame rate cap (INFINITE: none requested)
+DWORD editorRefreshWait() {
+  if (!E.frame.pending) return INFINITE;
+  if (KILO_MAX_FPS <= 0) return 0;
+  DWORD since = GetTickCount() - E.frame.drawn_at;
+  DWORD interval = 1000 / KILO_MAX_FPS;
+  return since >= interval ? 0 : interval - since;
+}
+
+// Runs a requested refresh if the frame rate cap allows it and no input is waiting
+// Nonstop input still gets a frame every KILO_MAX_LATENCY ms
+void editorRefreshIfDue() {
+  if (editorRefreshWait() != 0) return;
+  DWORD waiting = 0;
+  GetNumberOfConsoleInputEvents(E.in_handle, &waiting);
+  if (waiting && GetTickCount() - E.frame.drawn_at < KILO_MAX_LATENCY) return;
+  editorRefreshScreen();
+}
+
+// Draw text on screen row-by-row, into the frame's cells
+void editorDrawRows() {
+  E.hl_sync_budget = HL_SYNC_BUDGET; // rows the highlighter may catch up on for this frame
+  E.hl_inline_budget = HL_INLINE_BUDGET;
+  E.hl_deferring = 0;
+  E.hl_pending = 0;
+  // Drop render/hl of rows that scrolled out of view so memory follows the viewport
+  if (E.drawn_rowoff < E.numrows) {
+    erow *row = editorRow(E.drawn_rowoff);
+    for (int r = E.drawn_rowoff; row && r < E.drawn_rowoff + E.drawn_screenrows; r++, row = editorRowNext(row))
+      if (r < E.rowoff || r >= E.rowoff + E.screenrows)
+        editorEvictRow(row);
+  }
+  E.drawn_rowoff = E.rowoff;
+  E.drawn_screenrows = E.screenrows;
+
+  // Selection is made canonical once per frame; each row turns it into a span of render columns
+  struct textSelection canon = {0};
+  canon.taily = -1; // no selection: no row is in it
+  if (E.selection != NULL) canon = canonicalSelection(E.selection);
+
   // Draw column of ~'s to signify lines after EOF 
   for (int y = 0; y < E.screenrows; y++) {
     int filerow = y + E.rowoff;
-    int in_selection = 0;
+    struct frameCell *line = &E.frame.next[y * E.frame.cols];
+    int x = 0; // cells of line drawn so far
     if (filerow >= E.numrows) {
       if (E.numrows == 0 && y == E.screenrows / 3) {
         // Write welcome message for blank file
@@ -1500,77 +4491,96 @@ void editorDrawRows(struct abuf *ab) {
         // Center message
         int padding = (E.screencols - welcomelen) / 2;
         if (padding) {
-          abAppend(ab, "~", 1);
+          editorFrameFill(&line[x++], 1, '~', 0, 0);
           padding--;
         }
-        while (padding--) abAppend(ab, " ", 1);
-        abAppend(ab, welcome, welcomelen);
+        editorFrameFill(&line[x], padding, ' ', 0, 0);
+        x += padding;
+        for (int i = 0; i < welcomelen; i++)
+          editorFrameFill(&line[x++], 1, welcome[i], 0, 0);
       } 
-      else abAppend(ab, "~", 1);
+      else if (E.screencols > 0) editorFrameFill(&line[x++], 1, '~', 0, 0);
     } else {
-      int len = E.row[filerow].rsize - E.coloff;
+      erow *row = editorPrepareRow(filerow);
+      int rsize;
+      char *render = editorRowRenderText(row, &rsize); // tabs are expanded on the fly in render-free mode
+      int len = rsize - E.coloff;
       if (len < 0) len = 0;
       else if (len > E.screencols) len = E.screencols;
-      char *c = &E.row[filerow].render[E.coloff]; 
-
-      // Syntax highlighting
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
-      char current_color = -1;
-      for (int j = 0; j < len; j++) {
-        // If under selection: apply reversed colors
-        if (!in_selection && isInSelection(filerow, j)) {
-          abAppend(ab, "\x1b[7m", 4);
-          in_selection = 1;
-        } else if (in_selection && !isInSelection(filerow,j)) {
-          abAppend(ab, "\x1b[m", 3);
-          in_selection = 0;
-          if (current_color != -1) {
-            // set previous color back to normal
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            abAppend(ab, buf, clen);
-          }
+      char *c = len ? &render[E.coloff] : render;
+
+      // Screen columns of this row under the selection (chars headx..tailx on its first and
+      // last row, whole rows in between: those cost nothing, however big the selection is)
+      int sel_from = len, sel_to = len;
+      if (filerow >= canon.heady && filerow <= canon.taily) {
+        sel_from = 0;
+        sel_to = len;
+        if (filerow == canon.heady) {
+          int cx = canon.headx < row->size ? canon.headx : row->size;
+          sel_from = editorRowCxToRx(row, cx) - E.coloff;
         }
-
-        if (iscntrl(c[j])) {
-          // Draw control characters as printables w/ inverted colors
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?'; // \0 is @, others are capital letters, beyond is all ?s
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3); // resets text formatting
-          if (current_color != -1) {
-            // set previous color back to normal
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            abAppend(ab, buf, clen);
-          }
-        } else if (hl[j] == HL_NORMAL) {
-          if (current_color != -1) {
-            abAppend(ab, "\x1b[39m", 5); // reset text color to default
-            current_color = -1;
-          }
-          abAppend(ab, &c[j], 1);
-        } else {
-          char color = hl[j];
-          if (color != current_color) {
-            current_color = color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            abAppend(ab, buf, clen); // colored text
-          }
-          abAppend(ab, &c[j], 1);
+        if (filerow == canon.taily) {
+          int cx = canon.tailx + 1 < row->size ? canon.tailx + 1 : row->size; // tail is inclusive
+          sel_to = editorRowCxToRx(row, cx) - E.coloff;
+        }
+        if (sel_from < 0) sel_from = 0;
+        if (sel_to > len) sel_to = len;
+        if (sel_to <= sel_from) sel_from = sel_to = len;
+      }
+      // Find matches overlay: runs of matched columns, the next one is match_from..match_to
+      int m = E.find.query ? editorFindRowMatches(filerow) : E.find.nmatches;
+      int match_from, match_to;
+      editorFindNextRun(&m, row, filerow, len, &match_from, &match_to);
+
+      // Syntax highlighting: the line is drawn as runs of one color and selection state,
+      // split at span, match and selection boundaries
+      hlSpan *span = row->hl;
+      hlSpan *span_end = row->hl + row->nhl;
+      int j = 0;
+      while (j < len) {
+        int col = j + E.coloff;
+        while (span < span_end && span->start + span->len <= col) span++;
+        if (j >= match_to) editorFindNextRun(&m, row, filerow, len, &match_from, &match_to);
+
+        int color = 0; // default color
+        int end = len;
+        if (span < span_end) {
+          if (span->start <= col) {
+            color = span->hl;
+            end = span->start + span->len - E.coloff;
+          } else
+            end = span->start - E.coloff;
+        }
+        if (j >= match_from && j < match_to) {
+          color = HL_MATCH;
+          if (match_to < end) end = match_to;
+        } else if (match_from > j && match_from < end)
+          end = match_from;
+        int selected = (j >= sel_from && j < sel_to);
+        if (selected && sel_to < end) end = sel_to;
+        else if (!selected && sel_from > j && sel_from < end) end = sel_from;
+        int attr = selected ? FRAME_REVERSE : 0; // selection is drawn w/ reversed colors
+
+        // Fill in the run, drawing control characters as printables w/ reversed colors
+        for (; j < end; j++) {
+          if (iscntrl(c[j])) {
+            char sym = (c[j] <= 26) ? '@' + c[j] : '?'; // \0 is @, others are capital letters, beyond is all ?s
+            editorFrameFill(&line[x++], 1, sym, color, FRAME_REVERSE);
+          } else
+            editorFrameFill(&line[x++], 1, c[j], color, attr);
         }
       }
-      abAppend(ab, "\x1b[39m", 5); // reset text color to default just in case
     }
-    if (in_selection) abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\x1b[K", 3); // erase everything right of the end of line
-    abAppend(ab, "\r\n", 2); 
+    editorFrameFill(&line[x], E.screencols - x, ' ', 0, 0); // clear the rest of the line
   }
+  if (E.hl_deferring) editorHighlightPost();
+  // Rows prepared outside a frame (e.g. by find) are highlighted on the spot
+  E.hl_deferring = 0;
+  E.hl_inline_budget = INT_MAX;
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[7m", 4); // inverts colors
+void editorDrawStatusBar() {
+  struct frameCell *line = &E.frame.next[E.screenrows * E.frame.cols];
   char status[80], rstatus[80];
   // Status shows: up to 20 chars of filename, num lines
   int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.filename ? E.filename : "[No Name]", E.numrows,
@@ -1578,56 +4588,70 @@ void editorDrawStatusBar(struct abuf *ab) {
   // Right-aligned status window: display index of current line
   int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", E.syntax ? E.syntax->filetype : "no ft", E.cy+1, E.numrows);
   if (len > E.screencols) len = E.screencols;
-  abAppend(ab, status, len);
 
-  while (len < E.screencols) {
-    if (E.screencols - len == rlen) {
-      // Reached up to where rstatus string should begin: print it and end!
-      abAppend(ab, rstatus, rlen);
-      break;
-    } else {
-      // Padding spaces between status and rstatus
-      abAppend(ab, " ", 1);
-      len++;
-    }
-  }
-  abAppend(ab, "\x1b[m", 3); // restores standard formatting
-  abAppend(ab, "\r\n", 2);  // new line for prompts
+  // Whole bar is drawn w/ inverted colors; rstatus only if it fits after status
+  editorFrameFill(line, E.screencols, ' ', 0, FRAME_REVERSE);
+  for (int i = 0; i < len; i++) line[i].ch = status[i];
+  if (E.screencols - len >= rlen)
+    for (int i = 0; i < rlen; i++) line[E.screencols - rlen + i].ch = rstatus[i];
 }
 
 // Draws a message if the message is less than 5 seconds old (disappears at refresh on button press)
-void editorDrawMessageBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar() {
+  struct frameCell *line = &E.frame.next[(E.screenrows + 1) * E.frame.cols];
+  editorFrameFill(line, E.screencols, ' ', 0, 0);
   int msglen = strlen(E.statusmsg);
   if (msglen > E.screencols) msglen = E.screencols;
   if (msglen && time(NULL) - E.statusmsg_time < 5)
-    abAppend(ab, E.statusmsg, msglen);
+    for (int i = 0; i < msglen; i++) line[i].ch = E.statusmsg[i];
+  else
+    msglen = 0;
+
+  // Match count of the search, right-aligned
+  if (E.find.query) {
+    char status[64];
+    int slen = editorFindStatus(status, sizeof(status));
+    if (msglen + 1 + slen <= E.screencols)
+      for (int i = 0; i < slen; i++) line[E.screencols - slen + i].ch = status[i];
+  }
 }
 
-// Clears screen and writes current data buffer 
+// Draws the frame and writes what changed since the last one to the terminal
+// Scrolling by less than a screen shifts the terminal's rows instead of writing them again; the
+// whole screen is only written after a resize, a horizontal scroll or a jump (or w/ Ctrl-L)
 void editorRefreshScreen() {
   editorScroll();
-
-  struct abuf ab = ABUF_INIT;
-
-  // Write clearScreen commands to buffer
-  abAppend(&ab, "\x1bp?25l", 6); // Hide cusor
-  abAppend(&ab, "\x1b[H",  3); // Reposition cursor at top
-
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+  editorFrameResize();
+  int scrolled = E.rowoff - E.frame.rowoff;
+  if (E.coloff != E.frame.coloff || scrolled >= E.screenrows || -scrolled >= E.screenrows || E.screenrows < 2)
+    E.frame.valid = 0;
+  if (!E.frame.valid) scrolled = 0;
+  E.frame.rowoff = E.rowoff;
+  E.frame.coloff = E.coloff;
+
+  editorDrawRows();
+  editorDrawStatusBar();
+  editorDrawMessageBar();
+
+  // The output buffer is kept from frame to frame: a refresh allocates nothing once it has grown
+  struct abuf *ab = &E.frame.out;
+  abReset(ab);
+  abAppend(ab, "\x1b[?25l", 6); // Hide cursor
+  if (scrolled) editorFrameScroll(ab, scrolled);
+  editorFrameFlush(ab);
 
   // Reposition cursor to cx,cy
-  char buf[32];
-  int buflen = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy-E.rowoff)+1, (E.rx-E.coloff)+1);
-  abAppend(&ab, buf, buflen);
+  abAppendCursor(ab, (E.cy-E.rowoff)+1, (E.rx-E.coloff)+1);
 
-  abAppend(&ab, "\x1b[?25h", 6); // Show cursor
+  abAppend(ab, "\x1b[?25h", 6); // Show cursor
 
   // Write buffer (w/ escape commands) to terminal
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+  write(STDOUT_FILENO, ab->b, ab->len);
+  E.frame.pending = 0;
+  E.frame.drawn_at = GetTickCount();
+  E.frame.last_bytes = ab->len;
+  E.frame.total_bytes += ab->len;
+  E.frame.refreshes++;
 }
 
 // Set formatted string w/ arbitrary args to editor status message
@@ -1648,12 +4672,49 @@ void initEditor() {
   E.rowoff = 0;
   E.coloff = 0;
   E.numrows = 0;
-  E.row = NULL;
+  E.blocks = NULL;
+  E.numblocks = 0;
+  E.blockcap = 0;
+  E.blockcounts = NULL;
   E.dirty = 0;
   E.filename = NULL;
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
   E.syntax = NULL;
+  E.syntaxdb = NULL;
+  E.syntaxdb_len = 0;
+  E.viewbuf = NULL;
+  E.viewbuflen = 0;
+  E.viewbuf_mapped = 0;
+  E.viewfile = NULL;
+  E.addbuf = NULL;
+  memset(&E.arena, 0, sizeof(E.arena));
+  E.hl_valid_rows = 0;
+  E.hl_sync_budget = 0;
+  E.hl_pending = 0;
+  E.hl_inline_budget = INT_MAX;
+  E.hl_deferring = 0;
+  E.row_version = 0;
+  E.render_free = KILO_RENDER_FREE;
+  E.find.query = NULL;
+  E.find.matches = NULL;
+  E.find.nmatches = E.find.cap = 0;
+  E.find.current = -1;
+  E.find.use_regex = 0;
+  E.find.searching = 0;
+  E.find.starts = NULL;
+  E.find.ends = NULL;
+  E.find.startscap = 0;
+  E.find.scratch = NULL;
+  E.find.scratchcap = 0;
+  E.find.re = NULL;
+  E.find.error = NULL;
+  E.find_pool.nworkers = 0; // started at the first big search
+  E.find_pool.chunks = NULL;
+  E.find_pool.nchunks = E.find_pool.chunkcap = 0;
+  E.drawn_rowoff = 0;
+  E.drawn_screenrows = 0;
+  memset(&E.frame, 0, sizeof(E.frame)); // sized at the first refresh
 
   if (!getWindowSize(&E.screenrows, &E.screencols)) die("getWindowSize");
   E.screenrows -= 2; // Make room for status bar and message prompts
@@ -1663,10 +4724,13 @@ void initEditor() {
 
   E.selection = NULL;
 
-  E.undoBuf = malloc(UNDOBUF_MAX_SIZE * sizeof(struct undoEvent));
+  E.undoBuf = calloc(UNDOBUF_MAX_SIZE, sizeof(struct undoEvent));
   E.undoBufSize = 0;
   E.redoBuf = malloc(UNDOBUF_MAX_SIZE * sizeof(struct undoEvent));
   E.redoBufSize = 0;
+
+  editorInitSeparators();
+  editorHighlightWorkerStart();
 }
 
 int main(int argc, char *argv[]) {
@@ -1675,14 +4739,18 @@ int main(int argc, char *argv[]) {
   E.out_handle = GetStdHandle(STD_OUTPUT_HANDLE);
   enableRawMode();
   initEditor();
+  char *syntax_file = getenv("KILO_SYNTAX");
+  editorLoadSyntaxFile(syntax_file ? syntax_file : KILO_SYNTAX_FILE);
   if (argc >= 2)
     editorOpen(argv[1]);
 
-  editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-J = jump");
+  if (E.statusmsg[0] == '\0') // keep a syntax file error on screen
+    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-R = replace | Ctrl-J = jump");
 
+  FlushConsoleInputBuffer(E.in_handle);
   while (1) {
-    FlushConsoleInputBuffer(E.in_handle);
-    editorRefreshScreen();
+    // Keys queued up (auto-repeat, pastes) are all applied before the screen is refreshed
+    editorScheduleRefresh();
     editorProcessEvent();
   }
   return 0;
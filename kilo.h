@@ -12,19 +12,73 @@
 #define KILO_VERSION "WINKILO:1.1.0"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
+#define KILO_MAX_FPS 60 // cap on screen refreshes per second (0: no cap)
+#define KILO_MAX_LATENCY 100 // ms a refresh may be held back by input that keeps coming
+#define INPUT_MAX_RECORDS 6 // longest escape sequence read as one key
+#define KILO_RENDER_FREE 1 // 1: rows keep no render buffer, tabs are expanded on the fly when drawing/searching
 
 // Strips off 3 highest bits of input char (just like ctrl-)
 #define CTRL_KEY(k) ((k) & 0x1f)
 // Append buffer "constructor"
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
+#define ABUF_MIN_CAP 4096 // first allocation of an append buffer
+// Logical char i of a row: skips over the row's gap
+#define ROW_CHAR(row, i) ((i) < (row)->gap ? (row)->chars[i] : (row)->chars[(i) + (row)->cap - (row)->size])
+// Add/test byte c in a regex byte class (a 32-byte bitmap)
+#define RE_SET(cls, c) ((cls)[(unsigned char)(c) >> 3] |= 1 << ((unsigned char)(c) & 7))
+#define RE_HAS(cls, c) ((cls)[(unsigned char)(c) >> 3] & (1 << ((unsigned char)(c) & 7)))
 // Escape code key
 #define ESC '\x1b'
 
 // Highlight flags
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
+#define HL_NOCASE (1<<2) // keywords match regardless of case
+#define HL_LABELS (1<<3) // a word that starts a line and ends in ':' is a label
 
 #define UNDOBUF_MAX_SIZE 1
+#define ROWBLOCK_MAX 256 // rows per block of the row tree
+#define ROWBLOCK_FILL (ROWBLOCK_MAX * 3 / 4) // rows put in a freshly split block (leaves room to insert)
+#define ROW_MIN_CAP 16 // smallest buffer (chars + gap) of a row that gets typed into
+#define ADDBUF_CHUNK_SIZE (64*1024) // minimum size of each add buffer chunk
+#define HL_SYNC_BUDGET 20000 // rows (or clean blocks) a redraw may walk to catch up on multiline comment state
+#define HL_IDLE_BUDGET 20000 // rows rescanned per idle slice while waiting for input
+#define HL_INLINE_BUDGET 16384 // bytes of rows a frame highlights itself; the rest of the screen goes to the worker
+#define ARENA_MIN_CLASS 16 // smallest row buffer handed out by the arena (one size class per power of two)
+#define ARENA_NUM_CLASSES 9 // size classes 16 B .. 4 KB; bigger buffers get their own heap block
+#define ARENA_SLAB_SIZE (256*1024) // size classes are carved out of slabs of this size
+#define RE_MAX_DFA_STATES 1024 // lazy DFA states a regex caches per direction before the cache is flushed
+#define FIND_PARALLEL_ROWS 100000 // buffers w/ at least this many rows are searched by the find thread pool
+#define FIND_CHUNK_ROWS 8192 // rows (whole blocks) a find worker claims at a time
+#define FIND_MAX_WORKERS 16
+#define FIND_REGEX_SCAN 4 // forward regex bytes scanned per char of a row before its match ends are computed in one pass
+#define FIND_BMH_MIN 4 // queries at least this long are searched w/ Boyer-Moore-Horspool, shorter ones w/ memchr
+#define KILO_SYNTAX_FILE "kilo.syntax" // syntax definitions loaded at startup (the KILO_SYNTAX env var overrides the path)
+#define LEX_MAX_DELIM 8 // longest comment delimiter a syntax may use
+#define LEX_MAX_STATES 0x10000 // states a compiled syntax may have (state numbers are 16 bits)
+#define LEX_MAX_STOPS 4 // a state left by at most this many bytes skips runs of the others (editorLexSkip())
+
+// Transition of a compiled syntax (struct lexTable): next state, lexClass of the byte read,
+// and the bytes before it to repaint now that their class is known (LEX_FILL_TOKEN: back to the token start)
+#define LEX_STATE(t) ((t) & 0xffff)
+#define LEX_CLASS(t) (((t) >> 16) & 0xf)
+#define LEX_FILL_CLASS(t) (((t) >> 20) & 0xf)
+#define LEX_FILL_LEN(t) ((int)(((t) >> 24) & 0x7f))
+#define LEX_FILL_MASK (0x7fu << 24)
+#define LEX_FILL_TOKEN 0x7f
+#define LEX_BEGIN (1u << 31) // the byte read starts a token
+#define LEX_ENTRY(cls, fill, fill_cls, begin) \
+  (((unsigned int)(cls) << 16) | ((unsigned int)(fill_cls) << 20) | ((unsigned int)(fill) << 24) | ((begin) ? LEX_BEGIN : 0))
+
+// Row flags
+#define ROW_CHARS_VIEW (1<<0) // chars points into E.viewbuf or the add buffer (read-only, not null-terminated) until first edit
+#define ROW_RENDER_STALE (1<<1) // render (and so hl) must be rebuilt from chars before use
+#define ROW_HL_STALE (1<<2) // hl must be recomputed before use
+#define ROW_TABS_KNOWN (1<<3) // ROW_HAS_TABS is current (cleared on every edit)
+#define ROW_HAS_TABS (1<<4) // chars contains a tab, so render differs from chars
+#define ROW_COMMENT_STALE (1<<5) // hl_open_comment must be recomputed (row is new, edited, or got a new predecessor)
+
+#define FRAME_REVERSE 1 // screen cell is drawn w/ reversed colors (selection, control chars, status bar)
 
 // Highlight colors
 enum colorCodes {
@@ -75,7 +129,39 @@ enum events {
   EVENT_DELETE_CHAR,
   EVENT_INSERT_STRING,
   EVENT_DELETE_STRING,
-  EVENT_INSERT_NEWLINE
+  EVENT_INSERT_NEWLINE,
+  EVENT_REPLACE
+};
+
+// Highlight classes produced by the compiled lexer (colored through lex_class_hl)
+enum lexClass {
+  LEX_NORMAL,
+  LEX_COMMENT,
+  LEX_MLCOMMENT,
+  LEX_KEYWORD1,
+  LEX_KEYWORD2,
+  LEX_STRING,
+  LEX_NUMBER,
+  LEX_LABEL,
+  LEX_NUM_CLASSES
+};
+
+// What the lexer is reading
+enum lexMode {
+  LEX_MODE_CODE,
+  LEX_MODE_STRING,
+  LEX_MODE_STRING_ESC, // char after a backslash in a string
+  LEX_MODE_MLCOMMENT,
+  LEX_MODE_LINECOMMENT
+};
+
+// Kind of number being read
+enum lexNumber {
+  LEX_NUM_NONE,
+  LEX_NUM_DEC,
+  LEX_NUM_ZERO, // a lone leading 0 (may still turn into a 0x/0b prefix)
+  LEX_NUM_HEX,
+  LEX_NUM_BIN
 };
 /*** DATA ***/
 
@@ -87,33 +173,352 @@ struct editorSyntax {
   char *multiline_comment_start;
   char *multiline_comment_end;
   int flags;
+  char **hex_prefixes; // number prefixes: one symbol ("$") or '0' and a letter ("0x"), NULL terminated
+  char **bin_prefixes;
+  struct keywordTrie *keyword_trie; // keywords compiled on first use (editorCompileKeywords())
+  struct lexTable *lexer; // whole syntax compiled on first use (editorCompileSyntax())
+};
+
+// Node of a keyword trie: one char of one or more keywords
+struct keywordNode {
+  char c;
+  unsigned char hl; // LEX_KEYWORD1/2 if a keyword ends here
+  int kw;      // index in the syntax's keyword list of the keyword ending here, -1 if none
+  int child;   // first node for the next char, -1 if none
+  int sibling; // next node for another char at this position, -1 if none
+};
+
+// Keywords of a syntax compiled into a trie; the first char is looked up directly
+struct keywordTrie {
+  int first[256]; // node of each first char, -1 if no keyword starts with it
+  struct keywordNode *nodes;
+  int numnodes;
 };
 
+// Syntax compiled into a DFA: highlighting a line is one table lookup per byte
+struct lexTable {
+  unsigned int *next; // numstates * 256 transitions (LEX_STATE() etc.)
+  unsigned char *in_comment; // per state: inside a multiline comment
+  // Per state: the bytes that leave it (nstops > LEX_MAX_STOPS: too many to skip over), and the
+  // lexClass of every other byte, which keeps the state (comments and strings)
+  unsigned char *nstops;
+  unsigned char (*stops)[LEX_MAX_STOPS];
+  unsigned char *skip_class;
+  int numstates;
+  int start;         // state a line starts in
+  int comment_start; // state a line starts in when the previous one left a multiline comment open
+  // Only used while compiling: the lexer state behind each DFA state, and a hash of them
+  struct lexConfig *configs;
+  int *slots;
+  int nslots;
+};
+
+// State of the reference lexer that editorCompileSyntax() turns into DFA states
+struct lexConfig {
+  unsigned char mode;       // lexMode
+  unsigned char quote;      // char that closes the current string
+  unsigned char prev_sep;   // previous char was a separator
+  unsigned char prev_ident; // previous char was part of an identifier or number (alnum or '_')
+  unsigned char num;        // lexNumber being read
+  unsigned char label;      // current word started the line (HL_LABELS)
+  int kw;                   // keyword trie node of the current word, -1 if it can't be a keyword
+  char pending[LEX_MAX_DELIM]; // end of the text read that could still start a comment delimiter
+};
+
+// Run of rendered columns sharing one highlight; columns outside every span are HL_NORMAL
+typedef struct hlSpan {
+  int start;
+  int len;
+  unsigned char hl; // editorHighlight value
+} hlSpan;
+
 typedef struct erow {
-  int idx; // row number (used to check values in previous erow)
+  struct rowBlock *block; // block of the row tree holding this row (see editorRowIndex)
   int size;
   int rsize;
-  char *chars;   // characters typed in
-  char *render; // rendered chars (tabs to spaces)
-  unsigned char *hl; // highlights
+  int cap;  // bytes allocated for chars (0 for views); cap - size bytes form the gap
+  int gap;  // index in chars where the gap starts (== size when chars is contiguous)
+  int rcap; // bytes allocated for render
+  int nhl;   // number of spans in hl
+  int hlcap; // bytes allocated for hl
+  int render_from; // render is still valid for chars before this index
+  char *chars;   // characters typed in (w/ gap: use ROW_CHAR() or editorRowChars())
+  char *render; // rendered chars (tabs to spaces); NULL in render-free mode, see editorRowRenderText()
+  hlSpan *hl; // highlight spans, sorted by start
   int hl_open_comment;
+  int hl_prev_open_comment; // previous row's hl_open_comment when hl was computed
+  unsigned int version; // changes whenever the row's text or the syntax does (matches worker results to rows)
+  int flags; // ROW_* flags
 } erow;
 
+// Block of consecutive rows in the row tree
+struct rowBlock {
+  int index;   // position in E.blocks
+  int numrows;
+  int nstale;  // rows w/ ROW_COMMENT_STALE; 0 makes the block a highlighter checkpoint (editorSyncHighlightState())
+  erow rows[ROWBLOCK_MAX];
+};
+
+// Slab of the row arena; the slab's bytes follow the header
+struct arenaSlab {
+  struct arenaSlab *next;
+};
+
+// Header of a row buffer too big for any size class (kept in a list so teardown can find it)
+struct arenaLarge {
+  struct arenaLarge *prev, *next;
+};
+
+// Document-scoped allocator for row buffers: buffers are rounded up to a size class and
+// recycled through per-class free lists; closing the document frees the slabs wholesale
+struct rowArena {
+  struct arenaSlab *slabs;
+  char *bump;     // next free byte of the newest slab
+  char *bump_end;
+  void *freelist[ARENA_NUM_CLASSES];
+  struct arenaLarge *large;
+  // Counters (shown by Ctrl-T)
+  long allocs;      // buffers handed out
+  long frees;       // buffers given back
+  long grows_in_place; // reallocs that fit the buffer's size class
+  long heap_allocs; // mallocs made by the arena itself (slabs + large buffers)
+  long slabs_count;
+  long bytes_in_use;
+};
+
+// Row of a highlight batch: a snapshot of the row's rendered text, so the worker never touches erow
+struct hlBatchRow {
+  int at;               // row index when the snapshot was taken
+  unsigned int version; // erow.version then
+  int rsize;
+  char *text;
+  int in_comment;       // state entering the row; -1: the open_comment of the batch row before it
+  // Filled in by the worker
+  unsigned char *hl;    // rsize highlight bytes; NULL if the worker couldn't allocate them
+  int open_comment;
+};
+
+// Stale rows of the screen handed to the worker thread in one go (highlighted in order, so the
+// multiline comment state carries across rows that follow each other)
+struct hlBatch {
+  struct editorSyntax *syntax;
+  int numrows;
+  int cap;
+  struct hlBatchRow *rows;
+};
+
+// Background highlighter: one batch at a time; the UI thread only touches the batch while it
+// isn't busy, the worker only between work_event and done
+struct hlWorker {
+  HANDLE thread;
+  HANDLE work_event; // set by the UI thread when the batch is posted
+  HANDLE done_event; // set by the worker when it is done (wakes editorReadEvents())
+  volatile long done;
+  int busy; // batch posted and not collected yet
+  struct hlBatch batch;
+};
+
+// Regex program instruction (Thompson NFA)
+enum reOp {
+  RE_CLASS, // consume a byte in cls, go to x
+  RE_SPLIT, // go to x and y
+  RE_JMP,   // go to x
+  RE_BOL,   // at the start of the row, go to x
+  RE_EOL,   // at the end of the row, go to x
+  RE_MATCH
+};
+
+struct reInst {
+  int op;
+  int x, y;
+  unsigned char cls[32]; // RE_CLASS: bitmap of accepted bytes
+};
+
+// Parsed regex
+enum reNodeType { RE_N_CLASS, RE_N_CAT, RE_N_ALT, RE_N_STAR, RE_N_PLUS, RE_N_QUEST, RE_N_BOL, RE_N_EOL, RE_N_EMPTY };
+
+struct reNode {
+  int type;
+  struct reNode *left, *right;
+  unsigned char cls[32];
+};
+
+// Lazy DFA state: a set of program instructions (after epsilon moves); transitions are filled in
+// as bytes are met
+struct reDfaState {
+  int *set;
+  int nset;
+  int accept;     // the set holds RE_MATCH
+  int accept_end; // ...or reaches it through RE_EOL (match if the row ends here)
+  int next[256];  // -1: not computed yet
+};
+
+// Lazy DFA over one program; unanchored DFAs restart the program at every byte
+struct reDfa {
+  struct reInst *prog;
+  int ninst;
+  int unanchored;
+  int start[2]; // start state when not at/at the start of the row (-1: not built yet)
+  struct reDfaState **states;
+  int nstates;
+  int *slots; // hash table of states by set
+  int *mark;  // per instruction: gen when last added to the set being built
+  int gen;
+  int *stack;
+  int *set;   // set being built
+  int *reach; // editorRegexEnds(): furthest match end from each instruction, at two positions
+  int flushes; // times the state cache was dropped
+};
+
+// Compiled regex: the program runs forward anchored (match ends) and reversed unanchored (match starts)
+struct regex {
+  struct reDfa fwd;
+  struct reDfa rev;
+};
+
+// Occurrence of the find query
+struct findMatch {
+  int row;
+  int cx;
+  int len;
+};
+
+// Replaces len chars at cx w/ text (see editorRowSplice())
+struct rowEdit {
+  int cx;
+  int len;
+  char *text;
+  int textlen;
+};
+
+// Find state: every occurrence of the query in the buffer, kept up to date as rows are edited,
+// inserted or deleted (see editorFindUpdateRow(), editorFindShiftRows()) until the search is dropped
+struct findState {
+  char *query; // NULL: no search
+  int qlen;
+  int skip[256]; // Horspool shift for each byte (qlen >= FIND_BMH_MIN)
+  int use_regex; // query is a regex (toggled w/ Ctrl-R in the prompt)
+  struct regex *re; // compiled query in regex mode (NULL: query doesn't parse, see error)
+  const char *error;
+  double ms; // time the last full search took
+  int searching; // the find pool is still scanning (the match count isn't known yet)
+  struct findMatch *matches; // sorted by row, then cx
+  int nmatches;
+  int cap;
+  int current; // match the cursor was sent to (-1: none, e.g. after an edit)
+  unsigned char *starts; // regex match starts of the row being searched
+  int *ends; // ...and their longest ends, once editorRegexEnds() has taken over (startscap too)
+  int startscap;
+  char *scratch; // chars of a row w/ an open gap, copied out by editorFindRow()
+  int scratchcap;
+};
+
+// Consecutive blocks of rows searched by one find worker
+struct findChunk {
+  int first_block;
+  int nblocks;
+  int first_row;
+  struct findMatch *matches;
+  int nmatches;
+  int *gaps; // rows w/ an open gap, left to the UI thread (workers don't touch row buffers)
+  int ngaps;
+  int gapcap;
+  volatile long done;
+};
+
+struct findWorker {
+  HANDLE thread;
+  HANDLE work_event;
+  struct findState state; // copy of E.find w/ its own regex and match list
+};
+
+// Find thread pool: workers claim chunks in row order until none are left or the search is
+// cancelled; the UI thread waits, only drawing rows of chunks that are done
+struct findPool {
+  int nworkers; // 0: not started yet
+  struct findWorker workers[FIND_MAX_WORKERS];
+  HANDLE done_event; // set when a chunk is done and when the last worker stops
+  struct findChunk *chunks;
+  int nchunks;
+  int chunkcap;
+  volatile long next_chunk;
+  volatile long pending; // workers still scanning
+  volatile long cancel;
+};
+
+// abuf is just an appendable string with an easy-to-access len (instead of reading until 0)
+struct abuf {
+  char *b;
+  int len;
+  int cap;
+};
+
+// Screen cell: a char and the colors it is drawn w/
+struct frameCell {
+  char ch;
+  unsigned char color; // SGR foreground color, 0 for the default
+  unsigned char attr;  // FRAME_* flags
+};
+
+// Screen contents: the frame being drawn and the one last written to the terminal
+// Refreshes only write the cells that differ between the two
+struct frame {
+  int rows, cols;
+  struct frameCell *cells; // as on the terminal
+  struct frameCell *next;  // being drawn
+  int valid; // 0: terminal contents unknown, the next refresh writes every cell
+  int rowoff, coloff; // scroll position the cells were drawn at
+  long last_bytes; // bytes written to the terminal by the last refresh
+  long total_bytes;
+  long refreshes;
+  long requests; // editorScheduleRefresh() calls (coalesced into the refreshes)
+  int pending; // a refresh was requested
+  DWORD drawn_at; // GetTickCount() of the last refresh
+  struct abuf out; // escape sequences of the refresh, reused
+};
+
 // Contains editor state
 struct editorConfig {
   int cx, cy; // cursor coordinates into erow.chars
   int rx;    // cursor x into erow.render: same as cx when no tabs, else rx > cx
   int rowoff;  // index of top-drawn row
+  int drawn_rowoff, drawn_screenrows; // rows drawn by the last refresh (their render/hl are kept)
   int coloff;
   int screenrows; // number of rows available to draw on in console
   int screencols;
-  int numrows; // len of `row` array
-  erow *row;
+  int numrows; // number of rows in the document
+  // Row tree: rows are stored in blocks, accessed through editorRow()
+  struct rowBlock **blocks;
+  int numblocks;
+  int blockcap;
+  int *blockcounts; // Fenwick tree (1-based) of the row count of each block
   int dirty; // flag for whether file has been modified since last open/save
   char *filename;
   char statusmsg[80];
   time_t statusmsg_time;
   struct editorSyntax *syntax;
+  struct editorSyntax *syntaxdb; // definitions loaded from syntax files (searched before HLDB)
+  int syntaxdb_len;
+  int hl_valid_rows; // rows before this index have an up-to-date hl_open_comment
+  int hl_sync_budget; // rows/blocks editorSyncHighlightState() may still walk (reset per frame/idle slice)
+  int hl_pending; // rows on screen were highlighted before the state above them was caught up
+  int hl_inline_budget; // bytes the current frame may still highlight itself (HL_INLINE_BUDGET; INT_MAX between frames)
+  int hl_deferring; // the current frame handed rows to the worker: the rest of the screen goes too
+  unsigned int row_version; // last erow.version handed out
+  struct hlWorker hl_worker;
+  int render_free; // don't store erow.render (KILO_RENDER_FREE)
+  struct findState find; // matches are drawn over the rows' highlighting
+  struct findPool find_pool;
+  struct frame frame;
+  // Backing store for view rows: the memory-mapped file, or the buffer of the last save
+  char *viewbuf;
+  size_t viewbuflen;
+  int viewbuf_mapped;
+  HANDLE viewfile; // file viewbuf maps (see editorMapFile())
+  // Append-only store for inserted text: pasted lines and undo payloads point into it
+  struct addChunk *addbuf;
+  // Owner of every row buffer (chars, render, hl) of the document
+  struct rowArena arena;
   // IO handlers
   HANDLE in_handle;
   HANDLE out_handle;
@@ -140,10 +545,13 @@ struct textSelection {
   int headx, heady, tailx, taily;
 };
 
-// abuf is just an appendable string with an easy-to-access len (instead of reading until 0)
-struct abuf {
-  char *b;
-  int len;
+// Chunk of the add buffer: chunks are never moved or freed while the document is open,
+// so rows and undo events can point into them
+struct addChunk {
+  struct addChunk *next;
+  size_t len;
+  size_t cap;
+  char data[];
 };
 
 // Records events (that affect text) for undo/redo
@@ -152,8 +560,17 @@ struct abuf {
 struct undoEvent {
   int eventType; // Insert (1 char or paste multiple) / Delete (same)
   int cy, cx;   //  Coordinates of event
-  char* text;  //   Text that was inserted or deleted
+  char* text;  //   Text that was inserted or deleted (owned by the event, see undoEventSetText())
   int textlen;
+  int textcap;
+  // EVENT_REPLACE: text holds the replaced texts back to back, matches where they were and with
+  // what replaced them (both owned by the event too, see undoEventSetReplace())
+  struct findMatch *matches;
+  int nmatches;
+  int matchcap;
+  char *with;
+  int withlen;
+  int withcap;
 };
 
 // // Stack containing prior actions to undo
@@ -178,11 +595,14 @@ enum editorHighlight {
   HL_KEYWORD2 = HI_GREEN,
   HL_STRING = HI_PURPLE,
   HL_NUMBER = RED,
+  HL_LABEL = HI_CYAN,
   HL_MATCH = HI_BLUE
 };
 
 /* Highlight language database */
 char *C_HL_extensions[] = {".c", ".h", ".cpp", ".hpp", ".cc", NULL};
+char *C_HL_hex_prefixes[] = {"0x", "0X", NULL};
+char *C_HL_bin_prefixes[] = {"0b", "0B", NULL};
 // KEYWORD2 words end in |
 // For c: kw1 are general keywords, kw2 are types
 char *C_HL_keywords[] = {
@@ -196,11 +616,11 @@ char *C_HL_keywords[] = {
 };
 
 char *ASM6502_HL_extensions[] = {".asm", NULL};
+char *ASM6502_HL_hex_prefixes[] = {"$", NULL};
+char *ASM6502_HL_bin_prefixes[] = {"%", NULL};
 
 // TODO: color numbers by type (bin, dec, 0x, literal/addr)
 // TODO: assembler instructions (. commands)
-// TODO: labels
-// TODO: no case-sensitivity
 char *ASM6502_HL_keywords[] = {
   "ADC", "AND", "ASL", "BIT", "CLC", "CLD", "CLI", "CLV", "CMP", "CPX", "CPY",
   "DEC", "DEX", "DEY", "EOR", "INC", "INX", "INY", "LDA", "LDX", "LDY", "LSR",
@@ -220,14 +640,18 @@ struct editorSyntax HLDB[] = {
     C_HL_extensions,
     C_HL_keywords,
     "//", "/*", "*/",
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+    C_HL_hex_prefixes, C_HL_bin_prefixes,
+    NULL, NULL // compiled on first use
   },
   {
     "ASM 6502",
     ASM6502_HL_extensions,
     ASM6502_HL_keywords,
     ";", "", "",
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS | HL_NOCASE | HL_LABELS,
+    ASM6502_HL_hex_prefixes, ASM6502_HL_bin_prefixes,
+    NULL, NULL // compiled on first use
   }
 };
 
@@ -247,19 +671,97 @@ void matchScreenBufferToWindow();
 void restoreOriginalScreenBufferSize();
 
 /*** SYNTAX HIGHLIGHTING ***/
+void editorInitSeparators();
 int is_separator(int c);
-void editorUpdateSyntax(erow *row);
+void editorCompileKeywords(struct editorSyntax *s);
+int editorLexDelimEnds(char *text, int len, char *delim);
+void editorLexPending(char *text, int len, char **delims, int ndelims, char *pending);
+int editorLexPrefix(char **prefixes, int c0, int c1);
+int editorLexNumber(struct editorSyntax *s, struct lexConfig *cf, int c);
+void editorLexResetCode(struct lexConfig *cf);
+unsigned int editorLexStep(struct editorSyntax *s, struct lexConfig *cf, int c, struct lexConfig *out);
+int editorLexIntern(struct lexTable *lx, struct lexConfig *cf);
+int editorCompileSyntax(struct editorSyntax *s);
+void editorLexFindStops(struct lexTable *lx);
+int editorLexSkip(const char *p, int len, const unsigned char *stops, int nstops);
+void editorLexFill(unsigned char *hl, int i, int token, unsigned int t);
+int editorLexLine(struct lexTable *lx, char *render, int rsize, unsigned char *hl, int in_comment);
+int editorHighlightLine(char *render, int rsize, unsigned char *hl, int in_comment);
+unsigned char *editorHighlightScratch(int size);
+void editorRowSetSpans(erow *row, unsigned char *hl, int rsize);
+void editorRowSetHighlight(erow *row, unsigned char *hl, int rsize, int in_comment, int open_comment);
+void editorUpdateSyntax(erow *row, int in_comment);
+int editorScanCommentState(erow *row, int in_comment);
+void editorRowSetCommentStale(erow *row, int stale);
+int editorRowSyncState(erow *row, int in_comment);
+int editorSyncHighlightState(int at);
+erow *editorPrepareRow(int at);
+int editorHighlightIdle();
+DWORD WINAPI editorHighlightWorker(LPVOID arg);
+void editorHighlightWorkerStart();
+void editorHighlightDefer(erow *row, int at, int in_comment);
+void editorHighlightPost();
+int editorHighlightCollect();
+struct editorSyntax *editorFindSyntax(struct editorSyntax *db, int n);
 void editorSelectSyntaxHighlight();
 
+/*** SYNTAX FILES ***/
+char **editorSyntaxListAppend(char **list, char *s);
+void editorSyntaxListFree(char **list);
+char *editorSyntaxFileEnd();
+char *editorSyntaxFileLine(struct editorSyntax *s, char *key, char *args);
+void editorLoadSyntaxFile(const char *path);
+
+/*** ROW ARENA ***/
+int editorArenaClass(int size);
+int editorArenaClassSize(int size);
+void *editorArenaAlloc(int size, int *cap);
+void editorArenaFree(void *p, int cap);
+void *editorArenaRealloc(void *p, int oldcap, int size, int *cap);
+void editorArenaReset();
+void editorArenaStats();
+
+/*** ROW TREE ***/
+int editorBlockPrefix(int b);
+void editorBlockCountAdd(int b, int delta);
+int editorBlockFind(int at, int *off);
+erow *editorRow(int at);
+int editorRowIndex(erow *row);
+erow *editorRowFirst();
+erow *editorRowNext(erow *row);
+void editorInsertBlocks(int at, int n);
+void editorRowTreeRebuild();
+
 /*** ROW OPERATIONS ***/
+int editorRowHasTabs(erow *row);
 int editorRowCxToRx(erow *row, int cx);
 int editorRowRxToCx(erow *row, int rx);
+int editorRowMaxRenderLen(erow *row, int from);
+int editorRowExpandTabs(erow *row, int from, int rx, char *dst);
+void editorRenderRow(erow *row);
+char *editorRenderScratch(erow *row, int *rsize);
+char *editorRowRenderText(erow *row, int *rsize);
+void editorUpdateRowFrom(erow *row, int at);
 void editorUpdateRow(erow *row);
+void editorEvictRow(erow *row);
+void editorInitRows(struct rowBlock *block, int at, int n);
+void editorInsertRows(int at, int n);
+void editorDelRows(int at, int n);
+void editorFreeRows();
+void editorInsertRowChars(int at, char *chars, size_t len, int flags);
 void editorInsertRow(int at, char *s, size_t len);
 void editorFreeRow(erow *row);
+void editorDelRow(int at);
+void editorRowMaterialize(erow *row);
+void editorRowGrow(erow *row, int mincap);
+void editorRowMoveGap(erow *row, int at);
+char *editorRowChars(erow *row);
+void editorRowTruncate(erow *row, int len);
 void editorRowInsertChar(erow *row, int at, char c);
 void editorRowAppendString(erow *row, char *s, size_t len);
+void editorRowAppendView(erow *row, char *s, size_t len);
 void editorRowDelChar(erow *row, int at);
+void editorRowSplice(erow *row, struct rowEdit *edits, int n);
 
 /*** EDITOR OPERATIONS ***/
 int editorMatchSpaces(erow *row_src, erow *row_dst);
@@ -268,14 +770,68 @@ void editorInsertNewline(int match_spaces, int record_undo_event);
 void editorDelChar();
 void editorInsertText(char* text, int textlen, int record_undo_event);
 
+/*** FILE MAPPING ***/
+char *editorMapFile(const char *filename, size_t *len, HANDLE *file);
+void editorUnmapFile(char *map, size_t len, HANDLE file);
+void editorReleaseViewBuffer();
+void editorRebaseViewRows(char *buf, size_t buflen);
+
+/*** ADD BUFFER ***/
+char *editorAddBufAppend(const char *s, size_t len);
+int editorAddBufContains(const char *p);
+void editorAddBufFree();
+
 /*** FILE IO ***/
 char *editorRowsToString(int *buflen);
 void editorOpen(char *filename);
 void editorSave();
 
+/*** REGEX ***/
+struct reNode *editorRegexNode(int type, struct reNode *left, struct reNode *right);
+void editorRegexFreeNode(struct reNode *n);
+int editorRegexEscape(const char **p, unsigned char *cls);
+struct reNode *editorRegexAtom(const char **p, const char **error);
+struct reNode *editorRegexRepeat(const char **p, const char **error);
+struct reNode *editorRegexCat(const char **p, const char **error);
+struct reNode *editorRegexAlt(const char **p, const char **error);
+int editorRegexSize(struct reNode *n);
+void editorRegexEmit(struct reNode *n, struct reInst *prog, int *pc, int reverse);
+void editorRegexDfaInit(struct reDfa *dfa, struct reNode *root, int reverse, int unanchored);
+void editorRegexDfaFree(struct reDfa *dfa);
+void editorRegexAdd(struct reDfa *dfa, int pc, int bol, int *n);
+int editorRegexIntern(struct reDfa *dfa, int n);
+int editorRegexStart(struct reDfa *dfa, int bol);
+int editorRegexStep(struct reDfa *dfa, int st, unsigned char c);
+struct regex *editorRegexCompile(const char *pattern, const char **error);
+void editorRegexFree(struct regex *re);
+void editorRegexStarts(struct regex *re, const char *s, int len, unsigned char *starts);
+int editorRegexLongest(struct regex *re, const char *s, int len, int from, int *budget);
+void editorRegexEnds(struct regex *re, const char *s, int len, int from, int *ends);
+
 /*** FIND ***/
+char *editorMemSearch(char *hay, int len, char *needle, int nlen);
+char *editorBmhSearch(char *hay, int len, char *needle, int nlen, const int *skip);
+char *editorFindNext(struct findState *f, char *hay, int len);
+void editorFindAdd(struct findState *f, int row, int cx, int len);
+void editorFindText(struct findState *f, char *chars, int size, int at);
+char *editorFindScratch(struct findState *f, int size);
+void editorFindRow(struct findState *f, erow *row, int at);
+DWORD WINAPI editorFindWorker(LPVOID arg);
+void editorFindPoolStart();
+int editorFindChunkDone(struct findChunk *ch);
+int editorFindReportFirst();
+int editorFindParallel();
+int editorFindRowMatches(int row);
+void editorFindUpdateRow(erow *row);
+void editorFindShiftRows(int at, int n);
+void editorFindSetQuery(char *query);
+void editorFindReset();
+void editorFindNextRun(int *m, erow *row, int filerow, int len, int *from, int *to);
+int editorFindStatus(char *buf, int size);
 void editorFindCallback(char *query, int key);
 void editorFind();
+int editorReplaceMatches(struct findMatch *ms, int n, char *with, int withlen, int record_undo_event);
+void editorReplace();
 void editorJumpCallback(char *query, int key);
 void editorJump();
 
@@ -287,28 +843,49 @@ void deleteSelection(int record_undo_event);
 void copySelectionToClipboard();
 
 /*** UNDO/REDO ***/
+void undoEventSetText(struct undoEvent *event, const char *text, int textlen);
+void undoEventSetReplace(struct undoEvent *event, struct findMatch *ms, int n, const char *with, int withlen);
 void addUndoEvent(int eventType, int cy, int cx, char* text, int textlen);
+void addUndoReplace(struct findMatch *ms, int n, char *old, int oldlen, char *with, int withlen);
 void editorUndo();
 void editorRedo();
 
 /*** APPEND BUFFER ***/
+void abGrow(struct abuf *ab, int n);
 void abAppend(struct abuf *ab, const char *s, int len);
+void abAppendByte(struct abuf *ab, char c);
+void abAppendNum(struct abuf *ab, int n);
+void abAppendSgr(struct abuf *ab, int n);
+void abAppendCursor(struct abuf *ab, int row, int col);
+void abReset(struct abuf *ab);
 void abFree(struct abuf *ab);
 
 /*** INPUT ***/
-char *editorPrompt(char *prompt, int numeric, void (*callback)(char *, int));
+char *editorPrompt(char *prompt, int numeric, int allow_empty, void (*callback)(char *, int));
 void editorMoveCursor(int key, int shift_pressed);
 int editorReadEvents(HANDLE handle, char *pc, int n_records, DWORD* ctrl_key_states);
+int editorKeyPending();
 int editorReadKey();
 void editorProcessKeypress();
 void editorPasteFromClipboard();
 
 /*** OUTPUT ***/
 void editorScroll();
+void editorScrollTo(int row, int cx);
 void clearScreen();
-void editorDrawRows(struct abuf *ab);
-void editorDrawStatusBar(struct abuf *ab);
-void editorDrawMessageBar(struct abuf *ab);
+void editorFrameResize();
+void editorFrameFill(struct frameCell *cell, int n, char ch, int color, int attr);
+void editorFrameSgr(struct abuf *ab, int *color, int *attr, struct frameCell *cell);
+void editorFrameFlush(struct abuf *ab);
+void editorFrameScroll(struct abuf *ab, int n);
+void editorFrameInvalidate();
+void editorFrameStats();
+void editorScheduleRefresh();
+DWORD editorRefreshWait();
+void editorRefreshIfDue();
+void editorDrawRows();
+void editorDrawStatusBar();
+void editorDrawMessageBar();
 void editorRefreshScreen();
 void editorSetStatusMessage(const char *fmt, ...);
 